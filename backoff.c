@@ -0,0 +1,53 @@
+#include <syslog.h> /* the LOG_* levels */
+#include <unistd.h>
+
+#include "minicron.h"
+
+/*
+ * with -B, a job whose runs keep failing (exiting with non-zero, being killed or not starting at all) stops
+ * running for a while: after -B<duration>,<max>,<N> failures in a row its runs are skipped for duration, twice as
+ * long after every further failure up to max - the first run after that is the probe, and the first which
+ * succeeds ends the backoff, so a job whose dependency is down doesn't hammer it every interval
+ * the delays are jittered between half of them and all of them, so a fleet which started failing at the same
+ * moment doesn't come back in lockstep either
+ */
+static unsigned long long jitter(unsigned long long);
+
+/* xorshift64, seeded once, it only has to be different between the hosts */
+static unsigned long long jitter(unsigned long long n) {
+	static unsigned long long x;
+
+	if (x == 0)
+		x = (monotonic_ns() ^ wallclock_ns() ^ (unsigned long long)getpid() << 32) | 1;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return n / 2 + x % (n - n / 2 + 1);
+}
+
+/* called by child_ended() with whether the run failed */
+void backoff_ended(struct job *job, int failed) {
+	char delay[FMT_DURATION];
+	unsigned long long d;
+	unsigned int shift;
+
+	if (!failed) {
+		if (job->failures >= job->backoff_after && job->backoff)
+			log_msg(LOG_NOTICE, job, 0, "%s has succeeded after %u failures, running it again.", job->name, job->failures);
+		job->failures = 0;
+		job->backoff_until = 0;
+		return;
+	}
+	if (++job->failures < job->backoff_after || job->backoff == 0)
+		return;
+
+	shift = job->failures - job->backoff_after;
+	d = shift < 64 && job->backoff <= job->backoff_max >> shift ? job->backoff << shift : job->backoff_max;
+	d = jitter(d);
+	if (job->backoff_until == 0)
+		job->backoffs.opened++;
+	job->backoff_until = monotonic_ns() + d;
+	job->missed = 0; /* making up the missed runs would only fail as well */
+	fmt_duration(delay, d - d % NSEC_PER_MSEC);
+	log_msg(LOG_WARNING, job, 0, "%s has failed %u times in a row, skipping its runs for %s.", job->name, job->failures, delay);
+}
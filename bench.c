@@ -0,0 +1,399 @@
+/*
+ * runs the whole daemon, from its options and a job file of synthetic jobs, on a simulated clock with simulated
+ * children, so the numbers only depend on the jobs and the scheduler, not on the machine or its load
+ * with -DBENCH, minicron.h turns clock_gettime(2), ppoll(2), vfork(2), kill(2) and wait4(2) into the functions
+ * of this file: the clock only moves while the main loop waits, to its next timer or the next exit, and by -c
+ * for every spawn - a child is never executed, a no-op exits right away, a sleeper after -w, and one that
+ * ignores SIGTERM runs until it gets SIGKILL
+ * after the simulated time of -r it reports the tick lateness and the spawn latency of the metrics and how late
+ * -k and -K sent their signals (on the simulated clock, at the bucket bounds of the histograms), and the CPU time
+ * and the maximum RSS the run really took
+ */
+#include <errno.h>
+#include <libowfat/buffer.h>
+#include <libowfat/fmt.h>
+#include <libowfat/scan.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "minicron.h"
+
+/* the real ones in this file */
+#undef main
+#undef clock_gettime
+#undef ppoll
+#undef vfork
+#undef kill
+#undef wait4
+
+#define SIM_START NSEC_PER_SEC /* the monotonic clock at startup */
+#define SIM_EPOCH 1767225600ULL /* the wall clock at startup, 2026-01-01 00:00:00 UTC */
+#define SIM_PID 0x10000000 /* above any pid_max, so pidfd_open(2) fails and the children are reaped with wait4() */
+
+#define SIM_NOOP 0
+#define SIM_SLEEP 1
+#define SIM_STUBBORN 2 /* ignores SIGTERM */
+
+/* the child of a job, the PID of the child of job i is SIM_PID + i - the jobs only run one child at a time */
+struct simchild{
+	struct timer exit; /* when it exits, not on the heap for one that waits for SIGKILL */
+	struct simchild *next; /* the next one which has exited but hasn't been waited for */
+	unsigned short kind;
+	unsigned short exited;
+	int status;
+	unsigned long long deadline; /* the -k of the run, 0 without one */
+	unsigned long long term; /* when it got SIGTERM, 0 before */
+};
+
+static void put_milli(unsigned long long, unsigned int);
+static void put_ulong(unsigned long long, unsigned int);
+static unsigned long long percentile(struct histogram*, unsigned int);
+static void put_histogram(const char*, struct histogram*);
+static void sim_exit(struct simchild*, int);
+static void report();
+static int write_jobs(int);
+static void bench_usage(char*);
+
+static unsigned long long now = SIM_START, end;
+static unsigned long long interval = 60 * NSEC_PER_SEC, sleeping = 10 * NSEC_PER_SEC, kill_after = 5 * NSEC_PER_SEC, grace = KILL_TIMEOUT_CHILD;
+static unsigned long long runtime = 3600 * NSEC_PER_SEC, cost = 200000;
+static unsigned int counts[3] = { 1000, 100, 10 }, nsim;
+static struct simchild *sim, *zombies, **zombietail = &zombies;
+static struct timerheap exits;
+static struct histogram term_late, kill_late; /* from -k to SIGTERM, and from SIGTERM + -K to SIGKILL */
+static struct timespec real_start;
+static char jobfile[] = "/tmp/minicron-bench.XXXXXX";
+
+/* thousandths with three decimals, right-aligned in a column of the given width, ~0ULL is infinite */
+static void put_milli(unsigned long long u, unsigned int width) {
+	char buf[FMT_ULONG + 1];
+	unsigned int n;
+
+	if (u == ~0ULL)
+		n = fmt_str(buf, "inf");
+	else {
+		n = fmt_ulonglong(buf, u / 1000);
+		buf[n++] = '.';
+		n += fmt_uint0(buf + n, u % 1000, 3);
+	}
+	while (width-- > n)
+		buffer_puts(buffer_1, " ");
+	buffer_put(buffer_1, buf, n);
+}
+
+static void put_ulong(unsigned long long u, unsigned int width) {
+	char buf[FMT_ULONG];
+	unsigned int n = fmt_ulonglong(buf, u);
+
+	while (width-- > n)
+		buffer_puts(buffer_1, " ");
+	buffer_put(buffer_1, buf, n);
+}
+
+/* the upper bound of the bucket the q-th per mille falls into, ~0ULL for the last one */
+static unsigned long long percentile(struct histogram *h, unsigned int q) {
+	unsigned long long rank = (h->count * q + 999) / 1000, seen = 0;
+	unsigned int i;
+
+	if (h->count == 0)
+		return 0;
+	for (i = 0; i < HIST_BUCKETS - 1; i++)
+		if ((seen += h->bucket[i]) >= rank)
+			return hist_bound(i);
+	return ~0ULL;
+}
+
+static void put_histogram(const char *name, struct histogram *h) {
+	static const unsigned int q[] = { 500, 900, 990, 999, 1000 };
+	unsigned long long bound;
+	unsigned int i;
+
+	buffer_puts(buffer_1, name);
+	put_ulong(h->count, 24 - strlen(name));
+	put_milli(h->count ? h->sum / h->count / 1000 : 0, 10);
+	for (i = 0; i < sizeof(q) / sizeof(q[0]); i++) {
+		bound = percentile(h, q[i]);
+		put_milli(bound == ~0ULL ? bound : bound / 1000, 10);
+	}
+	buffer_puts(buffer_1, "\n");
+}
+
+int bench_clock_gettime(clockid_t id, struct timespec *ts) {
+	unsigned long long t;
+
+	if (id == CLOCK_MONOTONIC)
+		t = now;
+	else if (id == CLOCK_REALTIME)
+		t = SIM_EPOCH * NSEC_PER_SEC + (now - SIM_START);
+	else
+		return clock_gettime(id, ts);
+	ts->tv_sec = t / NSEC_PER_SEC;
+	ts->tv_nsec = t % NSEC_PER_SEC;
+	return 0;
+}
+
+/* sleeps on the simulated clock until the timeout or the next exit, which is reported with SIGCHLD - no fd is ever ready */
+int bench_ppoll(struct pollfd *fds, nfds_t n, const struct timespec *timeout, const sigset_t *mask) {
+	unsigned long long until = end;
+	struct timer *t;
+
+	(void)fds;
+	(void)n;
+	(void)mask;
+	if (timeout && now + timeout->tv_sec * NSEC_PER_SEC + timeout->tv_nsec < until)
+		until = now + timeout->tv_sec * NSEC_PER_SEC + timeout->tv_nsec;
+	if ((t = heap_top(&exits)) && t->when <= until) {
+		if (t->when > now)
+			now = t->when;
+		while ((t = heap_top(&exits)) && t->when <= now)
+			sim_exit(TIMER_OWNER(t, struct simchild, exit), 0);
+		catch_signal(SIGCHLD);
+		errno = EINTR;
+		return -1;
+	}
+	now = until;
+	if (now >= end)
+		report();
+	return 0;
+}
+
+/* start_child() takes the first free slot for the child once vfork(2) has returned */
+pid_t bench_vfork() {
+	struct job *job = state.free->job;
+	struct simchild *c = &sim[job - config.jobs.job];
+
+	now += cost;
+	c->exited = 0;
+	c->term = 0;
+	c->deadline = job->kill_after ? now + job->kill_after : 0;
+	if (c->kind == SIM_NOOP)
+		heap_insert(&exits, &c->exit, now);
+	else if (c->kind == SIM_SLEEP)
+		heap_insert(&exits, &c->exit, now + sleeping);
+	return SIM_PID + (c - sim);
+}
+
+int bench_kill(pid_t pid, int sig) {
+	struct simchild *c;
+
+	if (pid < SIM_PID || pid - SIM_PID >= (pid_t)nsim) {
+		errno = ESRCH;
+		return -1;
+	}
+	c = &sim[pid - SIM_PID];
+	if (c->exited) /* a zombie */
+		return 0;
+	if (sig == SIGTERM) {
+		c->term = now;
+		if (c->deadline && now >= c->deadline) /* not the kill of -o */
+			hist_record(&term_late, now - c->deadline);
+		if (c->kind != SIM_STUBBORN)
+			sim_exit(c, SIGTERM);
+	}
+	else if (sig == SIGKILL) {
+		if (c->term)
+			hist_record(&kill_late, now - c->term > grace ? now - c->term - grace : 0);
+		sim_exit(c, SIGKILL);
+	}
+	return 0;
+}
+
+/* the wait(2) status of the children which have exited, in the order they did */
+pid_t bench_wait4(pid_t pid, int *status, int options, struct rusage *ru) {
+	struct simchild *c, **p;
+
+	(void)options;
+	for (p = &zombies; (c = *p) && pid > 0 && SIM_PID + (c - sim) != pid; p = &c->next);
+	if (c == NULL)
+		return 0;
+	if ((*p = c->next) == NULL)
+		zombietail = p;
+	*status = c->status;
+	memset(ru, 0, sizeof(*ru));
+	return SIM_PID + (c - sim);
+}
+
+/* the child has exited with the wait(2) status, with a signal that is the signal */
+static void sim_exit(struct simchild *c, int status) {
+	heap_remove(&exits, &c->exit);
+	c->exited = 1;
+	c->status = status;
+	c->next = NULL;
+	*zombietail = c;
+	zombietail = &c->next;
+}
+
+static void report() {
+	unsigned long long outcomes[5] = { 0, 0, 0, 0, 0 }, spawns = metrics.spawn.count, cpu, real;
+	struct timespec ts;
+	struct rusage ru;
+	unsigned int i;
+
+	unlink(jobfile);
+	getrusage(RUSAGE_SELF, &ru);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	cpu = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * NSEC_PER_SEC + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+	real = (ts.tv_sec - real_start.tv_sec) * NSEC_PER_SEC + ts.tv_nsec - real_start.tv_nsec;
+	for (i = 0; i < nsim; i++) {
+		outcomes[0] += config.jobs.job[i].outcomes.ok;
+		outcomes[1] += config.jobs.job[i].outcomes.failed;
+		outcomes[2] += config.jobs.job[i].outcomes.terminated;
+		outcomes[3] += config.jobs.job[i].outcomes.killed;
+		outcomes[4] += config.jobs.job[i].outcomes.unstarted;
+	}
+
+	buffer_puts(buffer_1, "ticks ");
+	put_ulong(metrics.lateness.count, 0);
+	buffer_puts(buffer_1, ", runs ended ");
+	put_ulong(outcomes[0], 0);
+	buffer_puts(buffer_1, " ok, ");
+	put_ulong(outcomes[1], 0);
+	buffer_puts(buffer_1, " failed, ");
+	put_ulong(outcomes[2], 0);
+	buffer_puts(buffer_1, " terminated, ");
+	put_ulong(outcomes[3], 0);
+	buffer_puts(buffer_1, " killed, ");
+	put_ulong(outcomes[4], 0);
+	buffer_puts(buffer_1, " unstarted\nspawns ");
+	put_ulong(spawns, 0);
+	buffer_puts(buffer_1, ", ");
+	put_milli(spawns * 1000000 / (runtime / NSEC_PER_MSEC), 0);
+	buffer_puts(buffer_1, " per simulated second, ");
+	put_ulong(cpu >= 1000 ? spawns * NSEC_PER_MSEC / (cpu / 1000) : 0, 0);
+	buffer_puts(buffer_1, " per CPU second\n\n              ms   count      mean       p50       p90       p99     p99.9       max\n");
+	put_histogram("tick lateness", &metrics.lateness);
+	put_histogram("spawn latency", &metrics.spawn);
+	put_histogram("-k to SIGTERM", &term_late);
+	put_histogram("-K to SIGKILL", &kill_late);
+	buffer_puts(buffer_1, "\nCPU ");
+	put_milli(cpu / 1000, 0);
+	buffer_puts(buffer_1, " ms (");
+	put_milli(ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec, 0);
+	buffer_puts(buffer_1, " user), real ");
+	put_milli(real / 1000, 0);
+	buffer_puts(buffer_1, " ms, max RSS ");
+	put_ulong(ru.ru_maxrss, 0);
+	buffer_puts(buffer_1, " kB\n");
+	buffer_flush(buffer_1);
+	exit(0);
+}
+
+/* one line per job: the no-ops, the sleepers, then the ones which ignore SIGTERM */
+static int write_jobs(int fd) {
+	static const char *names[] = { "noop", "sleep", "stubborn" };
+	char line[128], *p;
+	unsigned int i, k, n = 0;
+
+	for (k = 0; k < 3; k++)
+		for (i = 0; i < counts[k]; i++, n++) {
+			sim[n].kind = k;
+			p = line;
+			p += fmt_str(p, "-n");
+			p += fmt_str(p, names[k]);
+			p += fmt_uint(p, i);
+			if (k == SIM_STUBBORN) {
+				p += fmt_str(p, " -k");
+				p += fmt_duration(p, kill_after);
+				p += fmt_str(p, " -K");
+				p += fmt_duration(p, grace);
+			}
+			*p++ = ' ';
+			p += fmt_duration(p, interval);
+			p += fmt_str(p, " /bin/sh\n"); /* never executed, but it has to be there */
+			if (write(fd, line, p - line) != p - line)
+				return 1;
+		}
+	return 0;
+}
+
+static void bench_usage(char *progname) {
+	buffer_puts(buffer_2, "usage: ");
+	buffer_puts(buffer_2, progname);
+	buffer_puts(buffer_2, " [-n<N>] [-s<N>] [-t<N>] [-i<duration>] [-w<duration>] [-k<duration>] [-K<duration>] [-r<duration>] [-c<duration>]\n\
+       [-S<duration>] [-C<N>] [-R<N>[,<burst>]]\n\
+Runs minicron on a simulated clock with simulated children and reports how the scheduler kept up.\n\
+-n<N> - N jobs which exit right away (default 1000)\n\
+-s<N> - N jobs which sleep for the duration of -w (default 100)\n\
+-t<N> - N jobs which ignore SIGTERM, killed after the duration of -k (default 10)\n\
+-i<duration> - run all jobs every duration (default 1m)\n\
+-w<duration> - how long the jobs of -s sleep (default 10s)\n\
+-k<duration> - the -k of the jobs of -t (default 5s)\n\
+-K<duration> - the -K of the jobs of -t (default 3s)\n\
+-r<duration> - how long to run on the simulated clock (default 1h)\n\
+-c<duration> - how long a spawn takes on the simulated clock (default 200us)\n\
+-S, -C and -R are passed on to minicron\n");
+	buffer_flush(buffer_2);
+}
+
+int main(int argc, char **argv) {
+	char *args[8] = { "minicron" }, fopt[sizeof(jobfile) + 2];
+	unsigned long long *d;
+	unsigned int *u;
+	int fd, i, nargs = 2, retval;
+
+	for (i = 1; i < argc; i++) {
+		d = NULL;
+		u = NULL;
+		switch (argv[i][0] == '-' ? argv[i][1] : '\0') {
+			case 'n': u = &counts[SIM_NOOP]; break;
+			case 's': u = &counts[SIM_SLEEP]; break;
+			case 't': u = &counts[SIM_STUBBORN]; break;
+			case 'i': d = &interval; break;
+			case 'w': d = &sleeping; break;
+			case 'k': d = &kill_after; break;
+			case 'K': d = &grace; break;
+			case 'r': d = &runtime; break;
+			case 'c': d = &cost; break;
+			case 'S':
+			case 'C':
+			case 'R':
+				if (nargs < 7) {
+					args[nargs++] = argv[i];
+					continue;
+				}
+				/* fallthrough */
+			default:
+				bench_usage(argv[0]);
+				return 11;
+		}
+		if ((u && (argv[i][2 + scan_uint(argv[i] + 2, u)] != '\0' || argv[i][2] == '\0')) || (d && !parse_duration(argv[i] + 2, d))) {
+			bench_usage(argv[0]);
+			return 12;
+		}
+	}
+	if (interval == 0 || runtime < NSEC_PER_MSEC) {
+		bench_usage(argv[0]);
+		return 12;
+	}
+
+	nsim = counts[SIM_NOOP] + counts[SIM_SLEEP] + counts[SIM_STUBBORN];
+	if ((sim = calloc(nsim ? nsim : 1, sizeof(struct simchild))) == NULL || heap_reserve(&exits, nsim))
+		return 111;
+	if ((fd = mkstemp(jobfile)) < 0)
+		return 111;
+	if (write_jobs(fd)) {
+		close(fd);
+		unlink(jobfile);
+		return 111;
+	}
+	close(fd);
+
+	fopt[0] = '-';
+	fopt[1] = 'f';
+	strcpy(fopt + 2, jobfile);
+	args[1] = fopt;
+	args[nargs] = NULL;
+	end = SIM_START + runtime;
+	clock_gettime(CLOCK_MONOTONIC, &real_start);
+
+	/* only returns if minicron didn't like the options or the jobs */
+	retval = minicron_main(nargs, args);
+	unlink(jobfile);
+	return retval;
+}
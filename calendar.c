@@ -0,0 +1,408 @@
+#include <libowfat/scan.h>
+#include <poll.h>
+#include <string.h>
+#include <strings.h> /* strncasecmp(3) */
+#include <syslog.h> /* the LOG_* levels */
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+#include "minicron.h"
+
+/*
+ * a job runs on a calendar instead of an interval if a cron expression (minute hour day month weekday, like
+ * "15 3 * * *") or one of @hourly, @daily, @weekly, @monthly and @yearly is given in place of the interval
+ * the fields are compiled into bit masks when the job file is loaded, so the next run is found with a few
+ * ctz on the masks, carrying over into the next hour, day, month - and never by trying minute after minute
+ * the runs are found in local time and converted with mktime(3), so a change of the UTC offset (DST) moves them
+ * along: a run in the hour skipped in spring starts at the same minute of the next hour, and in the hour repeated
+ * in autumn only a calendar with * as the hour runs again, like in cron
+ * the timers are on the monotonic clock, so a step of the wall clock is watched for with a timerfd on Linux, and
+ * elsewhere by comparing both clocks once a minute - only then are the runs of the calendars put anew
+ */
+#define CAL_YEARS 28 /* the weekdays repeat after 28 years, so a calendar without a run in them has none at all */
+#define CAL_SCAN 1440 /* the most missed runs counted, a day of a run every minute */
+#define CAL_REWIND (3 * 3600 * NSEC_PER_SEC) /* a clock set back by less doesn't repeat the runs */
+#define CAL_CHECK (60 * NSEC_PER_SEC) /* without a timerfd, how often the clocks are compared */
+
+static const char *months = "janfebmaraprmayjunjulaugsepoctnovdec";
+static const char *wdays = "sunmontuewedthufrisat";
+
+static int parse_field(char*, unsigned int, unsigned int, const char*, unsigned long long*);
+static unsigned int weekday(int, int);
+static unsigned int month_days(const struct calendar*, int, int);
+static unsigned long long calendar_search(const struct calendar*, const struct tm*, unsigned long long);
+static void calendar_jumped();
+#ifdef __linux__
+static int clock_arm(int);
+static void clock_ready(struct watcher*, short);
+#else
+static void clock_check(struct timer*, unsigned long long);
+#endif
+
+/* a number or a name of three letters, which count from lo */
+static size_t parse_value(char *s, unsigned int lo, const char *names, unsigned int *v) {
+	unsigned int i;
+
+	if (names)
+		for (i = 0; names[3 * i]; i++)
+			if (!strncasecmp(s, names + 3 * i, 3)) {
+				*v = lo + i;
+				return 3;
+			}
+	return scan_uint(s, v);
+}
+
+/* a list of *, N or N-M, each with an optional /step, up to the next blank - returns how much was parsed, 0 on error */
+static int parse_field(char *s, unsigned int lo, unsigned int hi, const char *names, unsigned long long *mask) {
+	unsigned int first, last, step;
+	char *p = s;
+	size_t n;
+
+	*mask = 0;
+	do {
+		if (*p == '*') {
+			first = lo;
+			last = hi;
+			p++;
+		}
+		else {
+			if ((n = parse_value(p, lo, names, &first)) == 0)
+				return 0;
+			p += n;
+			last = first;
+			if (*p == '-') {
+				if ((n = parse_value(p + 1, lo, names, &last)) == 0)
+					return 0;
+				p += 1 + n;
+			}
+		}
+		step = 1;
+		if (*p == '/') {
+			if ((n = scan_uint(p + 1, &step)) == 0 || step == 0)
+				return 0;
+			p += 1 + n;
+			if (first == last) /* 5/15 is 5-hi/15 */
+				last = hi;
+		}
+		if (first < lo || last > hi || first > last)
+			return 0;
+		for (; first <= last; first += step)
+			*mask |= 1ULL << first;
+	} while (*p++ == ',');
+	p--;
+	if (*p != '\0' && *p != ' ' && *p != '\t')
+		return 0;
+	return p - s;
+}
+
+/* the cron expression or the @shortcut of the job, returns 0 on error */
+int parse_calendar(char *s, struct calendar *cal) {
+	static const struct { char *name; char *expr; } shortcuts[] = {
+		{ "@hourly", "0 * * * *" }, { "@daily", "0 0 * * *" }, { "@midnight", "0 0 * * *" },
+		{ "@weekly", "0 0 * * 0" }, { "@monthly", "0 0 1 * *" }, { "@yearly", "0 0 1 1 *" }, { "@annually", "0 0 1 1 *" }
+	};
+	unsigned long long mask[5];
+	static const unsigned int lo[5] = { 0, 0, 1, 1, 0 }, hi[5] = { 59, 23, 31, 12, 7 };
+	unsigned int i, d, w;
+	int n;
+
+	if (*s == '@') {
+		for (i = 0; i < sizeof(shortcuts) / sizeof(shortcuts[0]) && strcmp(s, shortcuts[i].name); i++);
+		return i < sizeof(shortcuts) / sizeof(shortcuts[0]) && parse_calendar(shortcuts[i].expr, cal);
+	}
+	for (i = 0; i < 5; i++) {
+		while (*s == ' ' || *s == '\t')
+			s++;
+		if ((n = parse_field(s, lo[i], hi[i], i == 3 ? months : i == 4 ? wdays : NULL, &mask[i])) == 0)
+			return 0;
+		s += n;
+	}
+	while (*s == ' ' || *s == '\t')
+		s++;
+	if (*s != '\0')
+		return 0;
+
+	memset(cal, 0, sizeof(*cal));
+	cal->minutes = mask[0];
+	cal->hours = mask[1];
+	cal->mdays = mask[2];
+	cal->months = mask[3];
+	if (mask[4] & 1 << 7) /* 7 is Sunday too */
+		mask[4] = (mask[4] | 1) & 0x7f;
+	/* like cron: if both day fields are restricted a day matching either one runs, if one is * only the other counts */
+	if (mask[2] != 0xfffffffe)
+		cal->dayrule |= CAL_MDAY;
+	if (mask[4] != 0x7f)
+		cal->dayrule |= CAL_WDAY;
+	for (w = 0; w < 7; w++)
+		for (d = 1; d <= 31; d++)
+			if (mask[4] & 1 << (w + d - 1) % 7)
+				cal->wdays[w] |= 1U << d;
+	return 1;
+}
+
+/* of the first day of the month, 0 is Sunday */
+static unsigned int weekday(int year, int mon) {
+	static const int t[12] = { 0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4 };
+
+	if (mon < 2)
+		year--;
+	return (year + year / 4 - year / 100 + year / 400 + t[mon] + 1) % 7;
+}
+
+/* the days of the month (0 is January) on which the calendar runs, bit n for day n */
+static unsigned int month_days(const struct calendar *cal, int year, int mon) {
+	static const unsigned int len[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	unsigned int days, n = len[mon];
+
+	if (mon == 1 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0))
+		n++;
+	switch (cal->dayrule) {
+		case CAL_MDAY:
+			days = cal->mdays;
+			break;
+		case CAL_MDAY | CAL_WDAY:
+			days = cal->mdays | cal->wdays[weekday(year, mon)];
+			break;
+		default: /* CAL_WDAY, or every day if neither is restricted */
+			days = cal->wdays[weekday(year, mon)];
+	}
+	return days & (0xffffffffU >> (31 - n)) & ~1U;
+}
+
+/* the first run after after, starting the search at the local time from on */
+static unsigned long long calendar_search(const struct calendar *cal, const struct tm *from, unsigned long long after) {
+	int year, mon, mday, hour, min, last;
+	unsigned long long m;
+	unsigned int d;
+	struct tm tm;
+	time_t t;
+
+	year = from->tm_year + 1900;
+	mon = from->tm_mon;
+	mday = from->tm_mday;
+	hour = from->tm_hour;
+	min = from->tm_min;
+	last = year + CAL_YEARS;
+
+	while (year < last) {
+		/* each step either finds its field or carries into the one above and starts it over */
+		if (min > 59) {
+			min = 0;
+			hour++;
+		}
+		if (hour > 23) {
+			hour = min = 0;
+			mday++;
+		}
+		if (!(cal->months & 1U << (mon + 1))) {
+			if (cal->months >> (mon + 2))
+				mon = __builtin_ctz(cal->months >> (mon + 2)) + mon + 1;
+			else {
+				year++;
+				mon = __builtin_ctz(cal->months) - 1;
+			}
+			mday = 1;
+			hour = min = 0;
+			continue;
+		}
+		d = mday > 31 ? 0 : month_days(cal, year, mon) >> mday;
+		if (d == 0) {
+			if (++mon == 12) {
+				mon = 0;
+				year++;
+			}
+			mday = 1;
+			hour = min = 0;
+			continue;
+		}
+		if (d & 1) {
+			if ((cal->hours >> hour) == 0) {
+				mday++;
+				hour = min = 0;
+				continue;
+			}
+			if (!(cal->hours >> hour & 1)) {
+				hour += __builtin_ctz(cal->hours >> hour);
+				min = 0;
+			}
+		}
+		else {
+			mday += __builtin_ctz(d);
+			hour = __builtin_ctz(cal->hours);
+			min = 0;
+		}
+		m = cal->minutes >> min;
+		if (m == 0) {
+			hour++;
+			min = 0;
+			continue;
+		}
+		min += __builtin_ctzll(m);
+
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = year - 1900;
+		tm.tm_mon = mon;
+		tm.tm_mday = mday;
+		tm.tm_hour = hour;
+		tm.tm_min = min;
+		tm.tm_isdst = -1;
+		if ((t = mktime(&tm)) != (time_t)-1 && (unsigned long long)t * NSEC_PER_SEC > after)
+			return (unsigned long long)t * NSEC_PER_SEC;
+		/* in the repeated hour, which mktime(3) has put into the first one - only a calendar running every hour also runs in the second */
+		if (t != (time_t)-1 && cal->hours == 0xffffff && tm.tm_isdst > 0) {
+			memset(&tm, 0, sizeof(tm));
+			tm.tm_year = year - 1900;
+			tm.tm_mon = mon;
+			tm.tm_mday = mday;
+			tm.tm_hour = hour;
+			tm.tm_min = min;
+			tm.tm_isdst = 0;
+			if ((t = mktime(&tm)) != (time_t)-1 && (unsigned long long)t * NSEC_PER_SEC > after)
+				return (unsigned long long)t * NSEC_PER_SEC;
+		}
+		min++;
+	}
+	return 0;
+}
+
+/* the wall clock time of the first run after the given one, 0 if there is none */
+unsigned long long calendar_next(const struct calendar *cal, unsigned long long after) {
+	unsigned long long next, again;
+	time_t t, lo, hi, mid;
+	struct tm tm;
+	long offset;
+
+	t = after / NSEC_PER_SEC;
+	if (localtime_r(&t, &tm) == NULL)
+		return 0;
+	offset = tm.tm_gmtoff;
+	tm.tm_min++; /* the runs are on the full minute, so the first candidate is the next one */
+	if ((next = calendar_search(cal, &tm, after)) == 0 || cal->hours != 0xffffff)
+		return next;
+
+	/* the clock is put back on the way there, the search has gone past the repeated hour, so it goes again from the change */
+	lo = t;
+	hi = next / NSEC_PER_SEC;
+	if (localtime_r(&hi, &tm) == NULL || tm.tm_gmtoff >= offset)
+		return next;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (localtime_r(&mid, &tm) == NULL)
+			return next;
+		if (tm.tm_gmtoff == offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	localtime_r(&hi, &tm);
+	if (tm.tm_sec) /* the change isn't on a full minute */
+		tm.tm_min++;
+	if ((again = calendar_search(cal, &tm, after)) && again < next)
+		return again;
+	return next;
+}
+
+/* how many runs there were after from up to and including to, and the last of them */
+unsigned long long calendar_missed(const struct calendar *cal, unsigned long long from, unsigned long long to, unsigned long long *last) {
+	unsigned long long n, t = from;
+
+	for (n = 0; n < CAL_SCAN && (t = calendar_next(cal, t)) && t <= to; n++)
+		*last = t;
+	return n;
+}
+
+/* called by mainloop() and reload(), watches for steps of the wall clock once a job runs on a calendar */
+int calendar_open() {
+	unsigned int i;
+
+	for (i = 0; i < config.jobs.njobs && config.jobs.job[i].calendar == NULL; i++);
+	if (i == config.jobs.njobs)
+		return 0;
+	state.clockoffset = wallclock_ns() - monotonic_ns();
+#ifdef __linux__
+	if (state.clockjump.ready)
+		return 0;
+	if ((state.clockjump.fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		return 1;
+	state.clockjump.events = POLLIN;
+	state.clockjump.ready = clock_ready;
+	if (clock_arm(state.clockjump.fd) || watch_add(&state.clockjump)) {
+		close(state.clockjump.fd);
+		state.clockjump.ready = NULL;
+		return 1;
+	}
+#else
+	state.clockcheck.fire = clock_check;
+	if (!state.clockcheck.slot)
+		heap_insert(&state.timers, &state.clockcheck, monotonic_ns() + CAL_CHECK);
+#endif
+	return 0;
+}
+
+#ifdef __linux__
+/* a timer which never expires, its read(2) fails with ECANCELED once the clock is set */
+static int clock_arm(int fd) {
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = wallclock_ns() / NSEC_PER_SEC + 10 * 366 * 86400;
+	return timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+
+static void clock_ready(struct watcher *w, short revents) {
+	unsigned long long expired;
+
+	(void)revents;
+	while (read(w->fd, &expired, sizeof(expired)) > 0);
+	if (clock_arm(w->fd))
+		log_msg(LOG_WARNING, NULL, 0, "Could not watch the wall clock anymore.");
+	calendar_jumped();
+}
+#else
+static void clock_check(struct timer *t, unsigned long long now) {
+	unsigned long long offset = wallclock_ns() - now;
+
+	if (offset - state.clockoffset + NSEC_PER_SEC > 2 * NSEC_PER_SEC) /* more than a second either way */
+		calendar_jumped();
+	heap_insert(&state.timers, t, now + CAL_CHECK);
+}
+#endif
+
+/*
+   the wall clock has been set: a run which is now in the past starts right away, with the missed ones as -U says,
+   and one which is now further away waits for it, unless the clock went back by more than CAL_REWIND
+*/
+static void calendar_jumped() {
+	unsigned long long now, wallclock, back, ahead;
+	struct job *job;
+	unsigned int i;
+
+	tzset(); /* the time zone may have been changed along */
+	now = monotonic_ns();
+	wallclock = wallclock_ns();
+	back = state.clockoffset - (wallclock - now);
+	ahead = (wallclock - now) - state.clockoffset;
+	if (back > ahead)
+		back = 0;
+	else
+		ahead = 0;
+	state.clockoffset = wallclock - now;
+	log_msg(LOG_NOTICE, NULL, 0, "The wall clock was set %s by %llu.%03llu s, rescheduling the calendars.", back ? "back" : "forward",
+		(back + ahead) / NSEC_PER_SEC, (back + ahead) / NSEC_PER_MSEC % 1000);
+
+	for (i = 0; i < config.jobs.njobs; i++) {
+		job = &config.jobs.job[i];
+		if (job->calendar == NULL || !job->run.slot)
+			continue;
+		if (back > CAL_REWIND)
+			job->fire = calendar_next(&job->cal, wallclock);
+		heap_remove(&state.timers, &job->run);
+		heap_insert(&state.timers, &job->run, job->fire > wallclock ? now + (job->fire - wallclock) : now);
+		lease_schedule(job);
+		persist_due(job);
+	}
+}
@@ -0,0 +1,214 @@
+#include <libowfat/fmt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h> /* the LOG_* levels */
+
+#include "minicron.h"
+
+/*
+ * a job with -A<job>[,<job>...] has no schedule of its own, it runs once all the jobs it names have succeeded
+ * since its last run - it is started from the exit of the last of them, without a shell in between, and like
+ * any other job it has its own -k, -o, output and metrics
+ * the jobs which became ready in one round of the event loop are started together by one timer due right away,
+ * and a job which becomes ready again before it has started is started once, the notifications coalesce
+ * load_jobs() resolves the names with chain_link(), the jobs all have to be in the same job file
+ */
+static int cmp_name(const void*, const void*);
+static struct job *find_job(struct job**, unsigned int, char*);
+static char *link_error(struct job*, char*, char*);
+
+/* by name, then by position, so duplicate names end up next to each other */
+static int cmp_name(const void *a, const void *b) {
+	const struct job *x = *(struct job * const*)a, *y = *(struct job * const*)b;
+	int c = strcmp(x->name, y->name);
+
+	return c ? c : (x > y) - (x < y);
+}
+
+/* the job of the name, NULL if there is none or more than one */
+static struct job *find_job(struct job **sorted, unsigned int n, char *name) {
+	unsigned int lo = 0, hi = n, mid;
+	int c;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((c = strcmp(name, sorted[mid]->name)) == 0) {
+			if ((mid > 0 && !strcmp(name, sorted[mid - 1]->name)) || (mid + 1 < n && !strcmp(name, sorted[mid + 1]->name)))
+				return NULL;
+			return sorted[mid];
+		}
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+/* the message for job_error(), the job names make it longer than the static ones */
+static char *link_error(struct job *job, char *what, char *name) {
+	static char msg[512];
+	size_t n = 0;
+
+	n += fmt_strn(msg + n, "-A of ", sizeof(msg) - 1 - n);
+	n += fmt_strn(msg + n, job->name, sizeof(msg) - 1 - n);
+	n += fmt_strn(msg + n, what, sizeof(msg) - 1 - n);
+	if (name)
+		n += fmt_strn(msg + n, name, sizeof(msg) - 1 - n);
+	msg[n] = '\0';
+	return msg;
+}
+
+/*
+   resolves the names of -A of all jobs of the table into job->preds, and fills the job->succ lists - returns
+   an error message if a name isn't the name of exactly one job, or if the jobs wait for each other
+*/
+char *chain_link(struct jobtable *t) {
+	struct job **sorted = NULL, **queue, *job, *pred;
+	unsigned int i, k, n, head, tail, edges = 0;
+	char *name, *next, *err = NULL;
+
+	for (i = 0; i < t->njobs && t->job[i].after == NULL; i++);
+	if (i == t->njobs)
+		return NULL;
+	if ((sorted = malloc(t->njobs * sizeof(struct job*))) == NULL)
+		return "out of memory";
+	for (i = 0; i < t->njobs; i++)
+		sorted[i] = &t->job[i];
+	qsort(sorted, t->njobs, sizeof(struct job*), cmp_name);
+
+	for (i = 0; i < t->njobs; i++) {
+		job = &t->job[i];
+		for (name = job->after; name; name = next) {
+			if ((next = strchr(name, ',')) != NULL)
+				*next++ = '\0';
+			if ((pred = find_job(sorted, t->njobs, name)) == NULL) {
+				err = link_error(job, " names no job or more than one: ", name);
+				goto out;
+			}
+			if (job->npreds == JOB_AFTER) {
+				err = link_error(job, " names too many jobs", NULL);
+				goto out;
+			}
+			for (k = 0; k < job->npreds && job->preds[k] != pred; k++);
+			if (k < job->npreds)
+				continue;
+			job->preds[job->npreds++] = pred;
+			pred->nsucc++;
+			edges++;
+		}
+	}
+	if ((t->chain = malloc(edges * sizeof(struct job*))) == NULL) {
+		err = "out of memory";
+		goto out;
+	}
+	for (i = n = 0; i < t->njobs; i++) {
+		t->job[i].succ = t->chain + n;
+		n += t->job[i].nsucc;
+		t->job[i].nsucc = 0;
+	}
+	for (i = 0; i < t->njobs; i++)
+		for (k = 0; k < t->job[i].npreds; k++) {
+			pred = t->job[i].preds[k];
+			pred->succ[pred->nsucc++] = &t->job[i];
+		}
+
+	/* everything which runs runs from a job on a schedule, the rest waits for itself - sorted is the queue of Kahn now */
+	queue = sorted;
+	for (i = head = tail = 0; i < t->njobs; i++) {
+		t->job[i].waiting = t->job[i].npreds; /* counted down here, it holds the bits once the job runs */
+		if (t->job[i].npreds == 0)
+			queue[tail++] = &t->job[i];
+	}
+	while (head < tail)
+		for (job = queue[head++], k = 0; k < job->nsucc; k++)
+			if (--job->succ[k]->waiting == 0)
+				queue[tail++] = job->succ[k];
+	for (i = 0; i < t->njobs; i++)
+		if (t->job[i].waiting) {
+			err = link_error(&t->job[i], " waits for itself", NULL);
+			break;
+		}
+
+out:
+	for (i = 0; i < t->njobs; i++)
+		t->job[i].waiting = 0;
+	free(sorted);
+	return err;
+}
+
+/* called by child_ended() with whether the run failed, marks the successors and puts the ready ones on state.ready */
+void chain_ended(struct job *job, int failed) {
+	unsigned int i, k, all;
+	struct job *next;
+
+	if (job->nsucc == 0 || job->retired || state.stopping)
+		return;
+	if (failed)
+		log_msg(LOG_INFO, job, 0, "%s has failed, not running the %u jobs after it.", job->name, job->nsucc);
+	for (i = 0; i < job->nsucc; i++) {
+		next = job->succ[i];
+		for (k = 0; next->preds[k] != job; k++);
+		if (failed) { /* the last run of every predecessor has to have succeeded */
+			next->waiting &= ~(1U << k);
+			continue;
+		}
+		next->waiting |= 1U << k;
+		all = (1U << next->npreds) - 1;
+		if (next->waiting != all)
+			continue;
+		next->waiting = 0;
+		if (next->paused) { /* see control.c */
+			log_msg(LOG_INFO, next, 0, "%s has succeeded, but %s is paused.", job->name, next->name);
+			continue;
+		}
+		if (next->ready) {
+			next->chained.coalesced++;
+			log_msg(LOG_DEBUG, next, 0, "%s is about to run already, %s has succeeded again (%llu times so far).", next->name, job->name, next->chained.coalesced);
+			continue;
+		}
+		log_msg(LOG_INFO, next, 0, "%s has succeeded, running %s after it.", job->name, next->name);
+		next->ready = 1;
+		next->nextready = NULL;
+		next->due = monotonic_ns(); /* the spawn latency counts from the exit */
+		*state.readytail = next;
+		state.readytail = &next->nextready;
+	}
+	if (state.ready && !state.chain.slot)
+		heap_insert(&state.timers, &state.chain, monotonic_ns());
+}
+
+/* starts the ready jobs in one go, called by the timer and before a reload moves the jobs */
+void chain_flush() {
+	unsigned long long now = monotonic_ns();
+	struct job *job;
+
+	heap_remove(&state.timers, &state.chain);
+	while ((job = state.ready)) {
+		state.ready = job->nextready;
+		job->ready = 0;
+		if (job->paused) /* see control.c */
+			continue;
+		job->chained.triggered++;
+		run_due(job, now);
+	}
+	state.readytail = &state.ready;
+}
+
+void chain_timer(struct timer *t, unsigned long long now) {
+	(void)t;
+	(void)now;
+	chain_flush();
+}
+
+/* called by mainloop_stop(), the ready jobs don't start anymore */
+void chain_stop() {
+	struct job *job;
+
+	heap_remove(&state.timers, &state.chain);
+	while ((job = state.ready)) {
+		state.ready = job->nextready;
+		job->ready = 0;
+	}
+	state.readytail = &state.ready;
+}
@@ -0,0 +1,465 @@
+#define _GNU_SOURCE /* accept4(2) on Linux */
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <syslog.h> /* the LOG_* levels */
+#include <unistd.h>
+
+#include "minicron.h"
+
+/*
+ * -X serves a UNIX stream socket which takes one command per line, with any number of job names, and answers
+ * it with a line per job and a last line, "ok <jobs>" or "error <why>":
+ *   list [<job>...]               "job <name> next=<ms>ms|- running=<n> paused=0|1 interval=<duration>|-"
+ *   run <job>...                  a run is due now, -o, -C, -R, -B and -l apply as usual
+ *   pause <job>...                no more runs start from its schedule or -A, a running child goes on
+ *   resume <job>...               the schedule goes on from the next run which isn't in the past
+ *   interval <duration> <job>...  the runs are every duration from now on
+ * a name of no job is answered with "unknown <name>", a job the command doesn't apply to with "skip <name>"
+ * a client may send all its commands at once, they are answered in order from the event loop - while the
+ * answers are stuck, the client isn't read, so it can't make us buffer without bound
+ * pause and interval last until a reload changes the job, the interval in the job file stays what it is compared by
+ */
+#define CONTROL_CLIENTS 8 /* connections served at a time, a new one closes the oldest */
+#define CONTROL_LINE 65536 /* the longest command, room for a few thousand job names */
+#define CONTROL_BACKLOG 65536 /* no more commands are run while that much of the answers is unsent */
+
+struct control_client{
+	struct watcher w;
+	unsigned long long since; /* when it connected, to find the oldest */
+	unsigned short closing; /* it has sent everything, or a line which is too long */
+	size_t reqlen;
+	char req[CONTROL_LINE];
+	char *resp;
+	size_t resplen, respsize, sent;
+};
+
+struct control_command{
+	const char *name;
+	int (*apply)(struct control_client*, struct job*, unsigned long long, unsigned long long); /* returns 0 for a skipped job */
+};
+
+static struct watcher listener = { -1, POLLIN, 0, NULL };
+static struct control_client clients[CONTROL_CLIENTS];
+static char *unix_path; /* unlinked again by control_close() */
+static struct job **byname; /* config.jobs by name, see control_index() */
+static unsigned int nbyname, byname_size;
+
+static int cmp_name(const void*, const void*);
+static unsigned int find_first(const char*);
+static void control_accept(struct watcher*, short);
+static void client_close(struct control_client*);
+static void client_watch(struct control_client*, short);
+static void client_ready(struct watcher*, short);
+static int client_flush(struct control_client*);
+static void client_run(struct control_client*);
+static void put(struct control_client*, const char*, ...) __attribute__((format(printf, 2, 3)));
+static char *word(char**);
+static void command(struct control_client*, char*);
+static void reschedule(struct job*, unsigned long long);
+static int do_list(struct control_client*, struct job*, unsigned long long, unsigned long long);
+static int do_run(struct control_client*, struct job*, unsigned long long, unsigned long long);
+static int do_pause(struct control_client*, struct job*, unsigned long long, unsigned long long);
+static int do_resume(struct control_client*, struct job*, unsigned long long, unsigned long long);
+static int do_interval(struct control_client*, struct job*, unsigned long long, unsigned long long);
+
+static const struct control_command commands[] = {
+	{ "list", do_list },
+	{ "run", do_run },
+	{ "pause", do_pause },
+	{ "resume", do_resume },
+	{ "interval", do_interval },
+	{ NULL, NULL }
+};
+
+/* by name, then by position */
+static int cmp_name(const void *a, const void *b) {
+	const struct job *x = *(struct job * const*)a, *y = *(struct job * const*)b;
+	int c = strcmp(x->name, y->name);
+
+	return c ? c : (x > y) - (x < y);
+}
+
+/* the first job of the name in byname, nbyname if there is none */
+static unsigned int find_first(const char *name) {
+	unsigned int lo = 0, hi = nbyname, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(byname[mid]->name, name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < nbyname && !strcmp(byname[lo]->name, name) ? lo : nbyname;
+}
+
+/* makes room for the index of n jobs, called by mainloop() and by reload() before the jobs change */
+int control_reserve(unsigned int n) {
+	struct job **p;
+
+	if (config.control == NULL || n <= byname_size)
+		return 0;
+	if ((p = realloc(byname, n * sizeof(struct job*))) == NULL)
+		return 1;
+	byname = p;
+	byname_size = n;
+	return 0;
+}
+
+/* sorts config.jobs into the index, once control_reserve() has made room for them */
+void control_index() {
+	unsigned int i;
+
+	if (config.control == NULL)
+		return;
+	for (i = 0; i < config.jobs.njobs; i++)
+		byname[i] = &config.jobs.job[i];
+	nbyname = config.jobs.njobs;
+	qsort(byname, nbyname, sizeof(struct job*), cmp_name);
+}
+
+int control_open() {
+	struct sockaddr_un sun;
+	int fd;
+
+	if (config.control == NULL)
+		return 0;
+	if (control_reserve(config.jobs.njobs))
+		return 1;
+	control_index();
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(config.control) >= sizeof(sun.sun_path))
+		return 1;
+	strcpy(sun.sun_path, config.control);
+	unlink(config.control); /* left behind by an earlier instance */
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0)
+		return 1;
+	/* only for the user we run as, before anybody can connect */
+	if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) || chmod(config.control, 0600) || listen(fd, CONTROL_CLIENTS)) {
+		close(fd);
+		return 1;
+	}
+	unix_path = config.control;
+
+	listener.fd = fd;
+	listener.ready = control_accept;
+	return watch_add(&listener);
+}
+
+void control_close() {
+	unsigned int i;
+
+	if (listener.fd < 0)
+		return;
+	for (i = 0; i < CONTROL_CLIENTS; i++)
+		client_close(&clients[i]);
+	watch_remove(&listener);
+	close(listener.fd);
+	listener.fd = -1;
+	if (unix_path)
+		unlink(unix_path);
+}
+
+static void control_accept(struct watcher *w, short revents) {
+	struct control_client *c, *oldest = NULL;
+	unsigned int i;
+	int fd;
+
+	(void)revents;
+	if ((fd = accept4(w->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) < 0)
+		return;
+
+	/* a free slot, or the one which has been connected for the longest time */
+	for (i = 0; i < CONTROL_CLIENTS; i++) {
+		c = &clients[i];
+		if (!c->w.slot)
+			break;
+		if (oldest == NULL || c->since < oldest->since)
+			oldest = c;
+	}
+	if (i == CONTROL_CLIENTS) {
+		c = oldest;
+		client_close(c);
+	}
+
+	c->w.fd = fd;
+	c->w.events = POLLIN;
+	c->w.ready = client_ready;
+	c->since = monotonic_ns();
+	c->closing = 0;
+	c->reqlen = 0;
+	c->resplen = c->sent = 0;
+	if (watch_add(&c->w))
+		close(fd);
+}
+
+static void client_close(struct control_client *c) {
+	if (!c->w.slot)
+		return;
+	watch_remove(&c->w);
+	close(c->w.fd);
+	c->w.fd = -1;
+}
+
+/* switches between reading the commands and writing the answers */
+static void client_watch(struct control_client *c, short events) {
+	if (c->w.events == events)
+		return;
+	watch_remove(&c->w);
+	c->w.events = events;
+	if (watch_add(&c->w))
+		close(c->w.fd);
+}
+
+static void client_ready(struct watcher *w, short revents) {
+	struct control_client *c = WATCHER_OWNER(w, struct control_client, w);
+	ssize_t r;
+
+	if (c->w.events == POLLIN) {
+		r = read(c->w.fd, c->req + c->reqlen, sizeof(c->req) - c->reqlen);
+		if (r < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				client_close(c);
+			return;
+		}
+		c->reqlen += r;
+		if (r == 0) { /* the commands are all there, the last one may lack its newline */
+			c->closing = 1;
+			if (c->reqlen && c->reqlen < sizeof(c->req))
+				c->req[c->reqlen++] = '\n';
+		}
+	}
+	else if (revents & (POLLERR | POLLHUP)) {
+		client_close(c);
+		return;
+	}
+
+	do {
+		client_run(c);
+		if (c->reqlen == sizeof(c->req)) {
+			put(c, "error the line is too long\n");
+			c->closing = 1;
+			c->reqlen = 0;
+		}
+		if (!client_flush(c))
+			return;
+	} while (memchr(c->req, '\n', c->reqlen));
+
+	if (c->closing)
+		client_close(c);
+	else
+		client_watch(c, POLLIN);
+}
+
+/* writes what it can of the answers, returns 1 once they are all written, 0 if they are stuck or the client is gone */
+static int client_flush(struct control_client *c) {
+	ssize_t r;
+
+	while (c->sent < c->resplen) {
+		r = write(c->w.fd, c->resp + c->sent, c->resplen - c->sent);
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				client_watch(c, POLLOUT);
+			else
+				client_close(c);
+			return 0;
+		}
+		c->sent += r;
+	}
+	c->resplen = c->sent = 0;
+	return 1;
+}
+
+/* runs the complete lines read so far, until the answers pile up */
+static void client_run(struct control_client *c) {
+	char *p = c->req, *nl;
+
+	while (c->resplen < CONTROL_BACKLOG && (nl = memchr(p, '\n', c->req + c->reqlen - p))) {
+		*nl = '\0';
+		command(c, p);
+		p = nl + 1;
+	}
+	c->reqlen -= p - c->req;
+	memmove(c->req, p, c->reqlen);
+}
+
+/* appends to the answers, the buffer of the client is kept and reused for the next connection */
+static void put(struct control_client *c, const char *fmt, ...) {
+	va_list ap;
+	size_t size;
+	char *p;
+	int n;
+
+	while (1) {
+		va_start(ap, fmt);
+		n = vsnprintf(c->resp + c->resplen, c->respsize - c->resplen, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if (c->resplen + n < c->respsize) {
+			c->resplen += n;
+			return;
+		}
+		size = c->respsize ? 2 * c->respsize : 4096;
+		while (size <= c->resplen + n)
+			size *= 2;
+		if ((p = realloc(c->resp, size)) == NULL)
+			return;
+		c->resp = p;
+		c->respsize = size;
+	}
+}
+
+/* the next word of the line, split off in place, NULL at its end */
+static char *word(char **line) {
+	char *p = *line, *w;
+
+	while (*p == ' ' || *p == '\t' || *p == '\r')
+		p++;
+	if (*p == '\0')
+		return NULL;
+	for (w = p; *p && *p != ' ' && *p != '\t' && *p != '\r'; p++);
+	if (*p)
+		*p++ = '\0';
+	*line = p;
+	return w;
+}
+
+static void command(struct control_client *c, char *line) {
+	unsigned long long now = monotonic_ns(), arg = 0;
+	const struct control_command *cmd;
+	unsigned int i, n = 0;
+	char *name, *d;
+
+	if ((name = word(&line)) == NULL) /* an empty line */
+		return;
+	for (cmd = commands; cmd->name && strcmp(cmd->name, name); cmd++);
+	if (cmd->name == NULL) {
+		put(c, "error unknown command %s\n", name);
+		return;
+	}
+	if (cmd->apply == do_interval && ((d = word(&line)) == NULL || !parse_duration(d, &arg) || arg == 0)) {
+		put(c, "error interval needs a duration\n");
+		return;
+	}
+	if (state.stopping && cmd->apply != do_list) {
+		put(c, "error stopping\n");
+		return;
+	}
+
+	if ((name = word(&line)) == NULL) {
+		if (cmd->apply != do_list) {
+			put(c, "error %s needs the names of the jobs\n", cmd->name);
+			return;
+		}
+		for (i = 0; i < config.jobs.njobs; i++)
+			n += do_list(c, &config.jobs.job[i], arg, now);
+	}
+	for (; name; name = word(&line)) {
+		if ((i = find_first(name)) == nbyname)
+			put(c, "unknown %s\n", name);
+		for (; i < nbyname && !strcmp(byname[i]->name, name); i++)
+			n += cmd->apply(c, byname[i], arg, now);
+	}
+	put(c, "ok %u\n", n);
+}
+
+/* puts the run timer of a paused or rescheduled job, the runs in the past are left out */
+static void reschedule(struct job *job, unsigned long long now) {
+	unsigned long long wallclock, tick;
+
+	if (job->after) /* started by chain.c */
+		return;
+	heap_remove(&state.timers, &job->run);
+	heap_remove(&state.timers, &job->claim);
+	if (job->calendar) {
+		wallclock = wallclock_ns();
+		if ((job->fire = calendar_next(&job->cal, wallclock)) == 0)
+			return;
+		heap_insert(&state.timers, &job->run, now + (job->fire - wallclock));
+	}
+	else {
+		if (job->interval && now > job->start && (tick = (now - job->start + job->interval - 1) / job->interval) > job->tick)
+			job->tick = tick;
+		heap_insert(&state.timers, &job->run, job->start + job->tick * job->interval);
+	}
+	lease_schedule(job);
+	persist_due(job);
+}
+
+static int do_list(struct control_client *c, struct job *job, unsigned long long arg, unsigned long long now) {
+	char interval[FMT_DURATION];
+
+	(void)arg;
+	if (job->interval)
+		fmt_duration(interval, job->interval);
+	else
+		strcpy(interval, "-");
+	if (job->run.slot)
+		put(c, "job %s next=%llums running=%u paused=%u interval=%s\n", job->name,
+			job->run.when > now ? (job->run.when - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC : 0, job->running, job->paused, interval);
+	else
+		put(c, "job %s next=- running=%u paused=%u interval=%s\n", job->name, job->running, job->paused, interval);
+	return 1;
+}
+
+static int do_run(struct control_client *c, struct job *job, unsigned long long arg, unsigned long long now) {
+	(void)c;
+	(void)arg;
+	log_msg(LOG_NOTICE, job, 0, "Running %s now, as asked over the control socket.", job->name);
+	job->due = now;
+	run_due(job, now);
+	return 1;
+}
+
+static int do_pause(struct control_client *c, struct job *job, unsigned long long arg, unsigned long long now) {
+	(void)c;
+	(void)arg;
+	(void)now;
+	if (job->paused)
+		return 1;
+	job->paused = 1;
+	heap_remove(&state.timers, &job->run);
+	heap_remove(&state.timers, &job->claim);
+	log_msg(LOG_NOTICE, job, 0, "Paused %s, as asked over the control socket.", job->name);
+	return 1;
+}
+
+static int do_resume(struct control_client *c, struct job *job, unsigned long long arg, unsigned long long now) {
+	(void)c;
+	(void)arg;
+	if (!job->paused)
+		return 1;
+	job->paused = 0;
+	reschedule(job, now);
+	log_msg(LOG_NOTICE, job, 0, "Resumed %s, as asked over the control socket.", job->name);
+	return 1;
+}
+
+static int do_interval(struct control_client *c, struct job *job, unsigned long long arg, unsigned long long now) {
+	char interval[FMT_DURATION];
+
+	if (job->interval == 0) { /* a calendar or -A */
+		put(c, "skip %s\n", job->name);
+		return 0;
+	}
+	if (job->file_interval == 0)
+		job->file_interval = job->interval;
+	job->interval = arg;
+	job->start = now;
+	job->tick = 1;
+	if (!job->paused)
+		reschedule(job, now);
+	fmt_duration(interval, arg);
+	log_msg(LOG_NOTICE, job, 0, "Running %s every %s from now on, as asked over the control socket.", job->name, interval);
+	return 1;
+}
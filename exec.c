@@ -0,0 +1,214 @@
+#define _GNU_SOURCE /* pipe2(2), O_PATH and execveat(2) on Linux */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h> /* the LOG_* levels */
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "minicron.h"
+#include "probes.h"
+
+/*
+ * the child of a job is checked once at startup, so a missing binary is an error message instead of a run
+ * which silently exits - with -x it is also kept open, and every run executes that very file with
+ * fexecve(2) or execveat(2), without looking the path up again, even if it has been replaced since
+ * a child which fails to set itself up or to execute writes the errno into a close-on-exec pipe, which the
+ * parent reads right after vfork(2) returns: nothing means the execve(2) went through
+ * the environment of a job with -E or -e is put together here too, in one allocation with the strings of -e,
+ * so a run passes a pointer and a reload can free the job file the strings came from
+ */
+#if defined(O_EXEC)
+#define EXEC_OPEN O_EXEC
+#elif defined(__linux__) && defined(O_PATH) && defined(SYS_execveat)
+#define EXEC_OPEN O_PATH
+#endif
+
+static int env_overridden(struct job*, unsigned int, const char*);
+static int exec_env(struct job*);
+static void exec_fail(struct proc*, int);
+static void exec_ready(struct watcher*, short);
+
+/* whether one of the -e from the option at from on names the variable of var */
+static int env_overridden(struct job *job, unsigned int from, const char *var) {
+	size_t len = strcspn(var, "=");
+	unsigned int i;
+
+	for (i = from; i < job->noptions; i++)
+		if (job->options[i][1] == 'e' && !strncmp(job->options[i] + 2, var, len)
+			&& (job->options[i][2 + len] == '=' || job->options[i][2 + len] == '\0'))
+			return 1;
+	return 0;
+}
+
+/* environ with -E and -e applied into job->envp, which stays NULL without them - returns 1 if out of memory */
+static int exec_env(struct job *job) {
+	unsigned int i, n = 0, k = 0;
+	size_t size = 0;
+	char **p, *s;
+
+	job->envp = NULL;
+	for (i = 0; i < job->noptions; i++)
+		if (job->options[i][1] == 'e') {
+			n++;
+			size += strlen(job->options[i] + 2) + 1;
+		}
+	if (n == 0 && !job->clearenv)
+		return 0;
+	if (!job->clearenv)
+		for (p = environ; *p; p++)
+			n++;
+	if ((job->envp = malloc((n + 1) * sizeof(char*) + size)) == NULL)
+		return 1;
+
+	if (!job->clearenv) /* the strings of environ stay, minicron itself never changes it */
+		for (p = environ; *p; p++)
+			if (!env_overridden(job, 0, *p))
+				job->envp[k++] = *p;
+	s = (char*)(job->envp + n + 1);
+	for (i = 0; i < job->noptions; i++)
+		if (job->options[i][1] == 'e' && strchr(job->options[i], '=') && !env_overridden(job, i + 1, job->options[i] + 2)) {
+			job->envp[k++] = s;
+			s = stpcpy(s, job->options[i] + 2) + 1;
+		}
+	job->envp[k] = NULL;
+	return 0;
+}
+
+/* called by mainloop() for every job, returns 1 if the child can't be executed */
+int exec_open(struct job *job) {
+	const char *err = NULL;
+	struct stat st;
+
+	job->exefd = -1;
+	if (exec_env(job)) {
+		log_msg(LOG_ERR, job, 0, "Could not allocate the environment of %s.", job->name);
+		return 1;
+	}
+	if (stat(job->child, &st))
+		err = strerror(errno);
+	else if (!S_ISREG(st.st_mode))
+		err = "not a regular file";
+	else if (access(job->child, X_OK))
+		err = strerror(errno);
+	if (err) {
+		log_msg(LOG_ERR, job, 0, "Could not execute %s: %s.", job->child, err);
+		return 1;
+	}
+	if (!job->hold_exe)
+		return 0;
+#ifdef EXEC_OPEN
+	if ((job->exefd = open(job->child, EXEC_OPEN | O_CLOEXEC)) >= 0)
+		return 0;
+#endif
+	log_msg(LOG_WARNING, job, 0, "Could not open %s, every run of %s executes the path.", job->child, job->name);
+	return 0;
+}
+
+/* the pipe of the errors of the child, before vfork(2) */
+void exec_start(struct proc *proc) {
+	int fds[2];
+
+	proc->exec.fd = proc->execw = -1;
+	proc->exec.ready = NULL;
+	if (pipe2(fds, O_CLOEXEC) == 0) {
+		proc->exec.fd = fds[0];
+		proc->execw = fds[1];
+	}
+}
+
+/* in the child: which step failed and how, the pipe is too small to fill up */
+static void exec_fail(struct proc *proc, int step) {
+	int report[2];
+
+	report[0] = step;
+	report[1] = errno;
+	if (proc->execw >= 0)
+		write(proc->execw, report, sizeof(report));
+	_exit(127);
+}
+
+/* in the child after the fds and the limits have been set up, doesn't return */
+void exec_child(struct proc *proc, int failed) {
+	struct job *job = proc->job;
+	char **envp = job->envp ? job->envp : environ;
+
+	if (failed)
+		exec_fail(proc, EXEC_SETUP);
+	if (job->exefd >= 0) {
+#if defined(O_EXEC)
+		fexecve(job->exefd, job->argv, envp);
+#elif defined(EXEC_OPEN)
+		syscall(SYS_execveat, job->exefd, "", job->argv, envp, AT_EMPTY_PATH);
+#endif
+		/* the interpreter of a script opens /dev/fd/N, which is closed by then */
+		if (errno != ENOENT)
+			exec_fail(proc, EXEC_EXEC);
+	}
+	execve(job->child, job->argv, envp);
+	exec_fail(proc, EXEC_EXEC);
+}
+
+/*
+   in the parent after vfork(2), the child has either called execve(2) or exited, so its end of the pipe is
+   closed and the read doesn't block - logs if the child didn't start, and records the spawn latency if it did
+*/
+void exec_started(struct proc *proc) {
+	struct job *job = proc->job;
+	unsigned long long latency;
+	int report[2];
+	ssize_t n = 0;
+
+	if (proc->execw >= 0) { /* a helper of -Z has it closed already */
+		close(proc->execw);
+		proc->execw = -1;
+	}
+	if (proc->exec.fd >= 0) {
+		n = read(proc->exec.fd, report, sizeof(report));
+		close(proc->exec.fd);
+		proc->exec.fd = -1;
+	}
+	if (n != sizeof(report)) {
+		proc->execfailed = 0;
+		latency = monotonic_ns() - proc->due;
+		hist_record(&metrics.spawn, latency);
+		MINICRON_EXEC_SUCCESS(job->name, latency);
+		return;
+	}
+
+	proc->execfailed = 1;
+	metrics.spawn_failures++;
+	MINICRON_EXEC_FAILURE(job->name, report[0], report[1]);
+	if (report[0] == EXEC_SETUP)
+		log_msg(LOG_ERR, job, 0, "Could not set up the child of %s: %s.", job->name, strerror(report[1]));
+	else
+		log_msg(LOG_ERR, job, 0, "Could not execute %s: %s.", job->child, strerror(report[1]));
+}
+
+/* a helper of -Z has been released, the event loop reads its report, so the runs due next don't wait for its execve(2) */
+void exec_watch(struct proc *proc) {
+	proc->execfailed = 0;
+	proc->exec.events = POLLIN;
+	proc->exec.ready = exec_ready;
+	if (proc->exec.fd < 0 || watch_add(&proc->exec))
+		exec_started(proc);
+}
+
+static void exec_ready(struct watcher *w, short revents) {
+	(void)revents;
+	exec_finish(WATCHER_OWNER(w, struct proc, exec));
+}
+
+/* called by exec_ready() and child_ended(), whichever comes first */
+void exec_finish(struct proc *proc) {
+	if (proc->exec.fd < 0 || proc->exec.ready == NULL)
+		return;
+	watch_remove(&proc->exec);
+	proc->exec.ready = NULL;
+	exec_started(proc);
+}
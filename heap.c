@@ -0,0 +1,98 @@
+#include <stdlib.h>
+
+#include "heap.h"
+
+static void sift_up(struct timerheap*, unsigned int);
+static void sift_down(struct timerheap*, unsigned int);
+
+static void sift_up(struct timerheap *h, unsigned int i) {
+	struct timer *x = h->t[i];
+
+	while (i > 1 && h->t[i / 2]->when > x->when) {
+		h->t[i] = h->t[i / 2];
+		h->t[i]->slot = i;
+		i /= 2;
+	}
+	h->t[i] = x;
+	x->slot = i;
+}
+
+static void sift_down(struct timerheap *h, unsigned int i) {
+	struct timer *x = h->t[i];
+	unsigned int c;
+
+	while ((c = 2 * i) <= h->n) {
+		if (c < h->n && h->t[c + 1]->when < h->t[c]->when)
+			c++;
+		if (h->t[c]->when >= x->when)
+			break;
+		h->t[i] = h->t[c];
+		h->t[i]->slot = i;
+		i = c;
+	}
+	h->t[i] = x;
+	x->slot = i;
+}
+
+/* the timer has been copied to a new place, the heap is pointed to the copy */
+void heap_moved(struct timerheap *h, struct timer *x) {
+	if (x->slot)
+		h->t[x->slot] = x;
+}
+
+/* makes room for n timers, so the inserts up to that size never allocate */
+int heap_reserve(struct timerheap *h, unsigned int n) {
+	struct timer **t;
+
+	if (n <= h->size)
+		return 0;
+	if ((t = realloc(h->t, (n + 1) * sizeof(struct timer*))) == NULL)
+		return 1;
+	h->t = t;
+	h->size = n;
+	return 0;
+}
+
+/* schedules the timer at when, or moves it there if it is already scheduled */
+int heap_insert(struct timerheap *h, struct timer *x, unsigned long long when) {
+	if (x->slot) {
+		if (when < x->when) {
+			x->when = when;
+			sift_up(h, x->slot);
+		}
+		else {
+			x->when = when;
+			sift_down(h, x->slot);
+		}
+		return 0;
+	}
+
+	if (h->n == h->size && heap_reserve(h, h->size ? 2 * h->size : 16))
+		return 1;
+	x->when = when;
+	h->t[++h->n] = x;
+	sift_up(h, h->n);
+	return 0;
+}
+
+void heap_remove(struct timerheap *h, struct timer *x) {
+	unsigned int i = x->slot;
+
+	if (i == 0)
+		return;
+	x->slot = 0;
+
+	/* move the last timer into the hole, it may have to go either way from there */
+	if (i == h->n--)
+		return;
+	h->t[i] = h->t[h->n + 1];
+	h->t[i]->slot = i;
+	if (i > 1 && h->t[i / 2]->when > h->t[i]->when)
+		sift_up(h, i);
+	else
+		sift_down(h, i);
+}
+
+struct timer *heap_top(struct timerheap *h) {
+	return h->n ? h->t[1] : NULL;
+}
@@ -0,0 +1,27 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+/*
+ * a binary min-heap of timers keyed on their deadline
+ * the timers are embedded in the structs they belong to, the heap only holds pointers to them,
+ * so inserting, removing and rescheduling a timer is O(log n) and never copies the owner
+ */
+struct timer{
+	unsigned long long when; /* the deadline on the monotonic clock, in nanoseconds */
+	unsigned int slot; /* 1-based position in the heap, 0 when the timer isn't scheduled */
+	void (*fire)(struct timer*, unsigned long long); /* called with the current time once the deadline has passed */
+};
+
+struct timerheap{
+	struct timer **t; /* t[1] is the earliest timer, t[0] is unused */
+	unsigned int n;
+	unsigned int size;
+};
+
+int heap_reserve(struct timerheap*, unsigned int);
+int heap_insert(struct timerheap*, struct timer*, unsigned long long);
+void heap_remove(struct timerheap*, struct timer*);
+void heap_moved(struct timerheap*, struct timer*);
+struct timer *heap_top(struct timerheap*);
+
+#endif
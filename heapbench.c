@@ -0,0 +1,115 @@
+/*
+ * measures how the timer heap scales with the number of jobs
+ * for every job count it reports the cost of scheduling all jobs, of firing the earliest timer and
+ * rescheduling it one interval later (what the main loop does on every run), and for comparison
+ * the cost of finding the earliest deadline by scanning all jobs, as the main loop did before the heap
+ */
+#include <libowfat/buffer.h>
+#include <libowfat/fmt.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "heap.h"
+
+#define FIRES 1000000
+#define SCAN_JOBS 100000000ULL /* the number of jobs looked at per job count by the scan */
+
+static unsigned long long now_ns();
+static unsigned long long rnd();
+static void put_ulong(unsigned long long, unsigned int);
+static void fired(struct timer*, unsigned long long);
+
+struct benchjob{
+	struct timer t;
+	unsigned long long interval;
+};
+
+static unsigned long long seed = 88172645463325252ULL;
+
+static unsigned long long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64, so every run schedules the same deadlines */
+static unsigned long long rnd() {
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+/* right-aligned in a column of the given width */
+static void put_ulong(unsigned long long u, unsigned int width) {
+	char buf[FMT_ULONG];
+	unsigned int n = fmt_ulonglong(buf, u);
+
+	while (width-- > n)
+		buffer_puts(buffer_1, " ");
+	buffer_put(buffer_1, buf, n);
+}
+
+static void fired(struct timer *t, unsigned long long now) {
+	(void)t;
+	(void)now;
+}
+
+int main() {
+	static const unsigned int counts[] = { 100, 1000, 10000, 100000, 1000000 };
+	struct timerheap h = { NULL, 0, 0 };
+	struct benchjob *jobs;
+	struct timer *t;
+	unsigned long long start, insert, fire, scan, min, passes, sink = 0;
+	unsigned int c, i, k, n;
+
+	buffer_puts(buffer_1, "    jobs  insert ns/job  fire+reschedule ns  scan ns/tick\n");
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		n = counts[c];
+		if ((jobs = calloc(n, sizeof(struct benchjob))) == NULL || heap_reserve(&h, n))
+			return 1;
+
+		/* intervals between 1 and 3600 seconds, phases spread over the first interval */
+		start = now_ns();
+		for (i = 0; i < n; i++) {
+			jobs[i].interval = (rnd() % 3600 + 1) * 1000000000ULL;
+			jobs[i].t.fire = fired;
+			heap_insert(&h, &jobs[i].t, rnd() % jobs[i].interval);
+		}
+		insert = now_ns() - start;
+
+		start = now_ns();
+		for (k = 0; k < FIRES; k++) {
+			t = heap_top(&h);
+			heap_remove(&h, t);
+			t->fire(t, t->when);
+			heap_insert(&h, t, t->when + ((struct benchjob*)t)->interval);
+		}
+		fire = now_ns() - start;
+
+		passes = SCAN_JOBS / n;
+		start = now_ns();
+		for (k = 0; k < passes; k++) {
+			min = ~0ULL;
+			for (i = 0; i < n; i++)
+				if (jobs[i].t.when < min)
+					min = jobs[i].t.when;
+			sink += min;
+			jobs[k % n].t.when++; /* keep the compiler from hoisting the scan out of the loop */
+		}
+		scan = now_ns() - start;
+
+		put_ulong(n, 8);
+		put_ulong(insert / n, 15);
+		put_ulong(fire / FIRES, 20);
+		put_ulong(scan / passes, 14);
+		buffer_puts(buffer_1, "\n");
+		buffer_flush(buffer_1);
+
+		for (i = 0; i < n; i++)
+			heap_remove(&h, &jobs[i].t);
+		free(jobs);
+	}
+
+	return sink == 0; /* uses the scan result */
+}
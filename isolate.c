@@ -0,0 +1,107 @@
+#define _GNU_SOURCE /* sched_setaffinity(2) on Linux */
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <syslog.h> /* the LOG_* levels */
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "minicron.h"
+
+/*
+ * keeps the jobs off the cores and the disks of the services they share the host with: the CPU affinity (-a),
+ * the nice level (-N) and the I/O priority (-I) are applied by child() between vfork(2) and execve(2),
+ * so no taskset, nice or ionice has to be exec'd in front of the job, and the limits of the cgroup of -g
+ * (-u for cpu.max, -m for memory.max) are written once at startup
+ */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+static int write_file(int, const char*, const char*);
+
+static int write_file(int dir, const char *name, const char *s) {
+	ssize_t n;
+	int fd;
+
+	if ((fd = openat(dir, name, O_WRONLY | O_CLOEXEC)) < 0)
+		return 1;
+	n = write(fd, s, strlen(s));
+	close(fd);
+	return n != (ssize_t)strlen(s);
+}
+
+/* creates the cgroup of -g if it doesn't exist yet and sets its limits, called before stats_open() */
+int isolate_open(struct job *job) {
+	char buf[64];
+	int dir;
+
+#ifndef __linux__
+	if (job->has_cpus || job->ioclass)
+		log_msg(LOG_WARNING, job, 0, "-a and -I of %s aren't supported on this system, ignoring them.", job->name);
+#endif
+	if (job->cgroup == NULL) {
+		if (job->cpu_max || job->memory_max) {
+			log_msg(LOG_ERR, job, 0, "-u and -m of %s need a cgroup, given with -g.", job->name);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (mkdir(job->cgroup, 0755) && errno != EEXIST) {
+		log_msg(LOG_ERR, job, 0, "Could not create the cgroup %s of %s.", job->cgroup, job->name);
+		return 1;
+	}
+	if ((dir = open(job->cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return 0; /* stats_open() complains */
+
+	/* the period is the default of the kernel, the quota a share of it per CPU */
+	if (job->cpu_max) {
+		snprintf(buf, sizeof(buf), "%llu 100000\n", job->cpu_max * 1000ULL);
+		if (write_file(dir, "cpu.max", buf)) {
+			log_msg(LOG_ERR, job, 0, "Could not set cpu.max of %s, is the cpu controller enabled for it?", job->cgroup);
+			close(dir);
+			return 1;
+		}
+	}
+	if (job->memory_max) {
+		snprintf(buf, sizeof(buf), "%llu\n", job->memory_max);
+		if (write_file(dir, "memory.max", buf)) {
+			log_msg(LOG_ERR, job, 0, "Could not set memory.max of %s, is the memory controller enabled for it?", job->cgroup);
+			close(dir);
+			return 1;
+		}
+	}
+	close(dir);
+	return 0;
+}
+
+/* in the child, everything is precomputed, so these are just the system calls - returns 1 if one failed */
+int isolate_child(struct job *job) {
+	int fd;
+
+	if (job->cgfd >= 0) {
+		if ((fd = openat(job->cgfd, "cgroup.procs", O_WRONLY)) < 0)
+			return 1;
+		if (write(fd, "0\n", 2) != 2) { /* 0 is the writing process */
+			close(fd);
+			return 1;
+		}
+		close(fd);
+	}
+#ifdef __linux__
+	/* cpu_set_t is a CPU_SETSIZE bit mask in unsigned longs, like job->cpus */
+	if (job->has_cpus && sched_setaffinity(0, sizeof(job->cpus), (cpu_set_t*)job->cpus))
+		return 1;
+	if (job->ioclass && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, job->ioclass << IOPRIO_CLASS_SHIFT | job->iolevel))
+		return 1;
+#endif
+	if (job->has_nice && setpriority(PRIO_PROCESS, 0, job->nice))
+		return 1;
+	return 0;
+}
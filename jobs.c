@@ -0,0 +1,533 @@
+#include <fcntl.h>
+#include <libowfat/buffer.h>
+#include <libowfat/fmt.h>
+#include <libowfat/scan.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "minicron.h"
+
+static int parse_uint(char*, unsigned int*);
+static int parse_cpus(char*, struct job*);
+static int parse_ioprio(char*, struct job*);
+static int parse_fds(char*, struct job*);
+static int parse_backoff(char*, struct job*);
+static int parse_lease(char*, struct job*);
+static unsigned int split_line(char*, char**);
+static void job_error(char*, unsigned int, char*);
+
+/* scan_uint(), but the whole string has to be a number */
+static int parse_uint(char *s, unsigned int *u) {
+	size_t n = scan_uint(s, u);
+	return n > 0 && s[n] == '\0';
+}
+
+/*
+ * parses a duration like 10, 1.5s, 250ms, 100us, 5m or 1h into nanoseconds, a number without a unit is in seconds
+ * the whole string has to be a duration, returns 0 on error
+ */
+int parse_duration(char *s, unsigned long long *ns) {
+	static const struct { char *suffix; unsigned long long ns; } units[] = {
+		{ "ns", 1 }, { "us", 1000 }, { "ms", NSEC_PER_MSEC }, { "s", NSEC_PER_SEC },
+		{ "m", 60 * NSEC_PER_SEC }, { "h", 3600 * NSEC_PER_SEC }, { "", NSEC_PER_SEC }
+	};
+	unsigned long long whole, frac = 0, scale = 1;
+	char *digits = NULL;
+	size_t n;
+	unsigned int i;
+
+	if ((n = scan_ulonglong(s, &whole)) == 0)
+		return 0;
+	s += n;
+	if (*s == '.')
+		for (digits = ++s; *s >= '0' && *s <= '9'; s++);
+
+	for (i = 0; i < sizeof(units) / sizeof(units[0]); i++)
+		if (!strcmp(s, units[i].suffix)) {
+			/* only the digits which still give whole nanoseconds count (down to 36ns for h), so frac stays below the unit */
+			for (; digits != NULL && digits < s && units[i].ns % (scale * 10) == 0; digits++) {
+				frac = frac * 10 + (*digits - '0');
+				scale *= 10;
+			}
+			frac *= units[i].ns / scale;
+			if (whole > (~0ULL - frac) / units[i].ns)
+				return 0;
+			*ns = whole * units[i].ns + frac;
+			return 1;
+		}
+	return 0;
+}
+
+/* parses a size like 4096, 64k, 1M or 2G into bytes, returns 0 on error */
+int parse_size(char *s, unsigned long long *bytes) {
+	unsigned long long u;
+	unsigned int shift = 0;
+	size_t n;
+
+	if ((n = scan_ulonglong(s, &u)) == 0)
+		return 0;
+	if (s[n] == 'k' || s[n] == 'K')
+		shift = 10;
+	else if (s[n] == 'M')
+		shift = 20;
+	else if (s[n] == 'G')
+		shift = 30;
+	if (s[n + (shift != 0)] != '\0' || u > (~0ULL >> shift))
+		return 0;
+	*bytes = u << shift;
+	return 1;
+}
+
+/* the policy of -U: skip, once, all or how many of the missed runs are made up at most, returns 0 on error */
+int parse_catchup(char *s, unsigned int *n) {
+	if (!strcmp(s, "skip"))
+		*n = 0;
+	else if (!strcmp(s, "once"))
+		*n = 1;
+	else if (!strcmp(s, "all"))
+		*n = CATCHUP_ALL;
+	else
+		return parse_uint(s, n);
+	return 1;
+}
+
+/* -B<duration>[,<max>[,<N>]], the commas are overwritten */
+static int parse_backoff(char *s, struct job *job) {
+	char *max, *after = NULL;
+
+	if ((max = strchr(s, ',')) != NULL) {
+		*max++ = '\0';
+		if ((after = strchr(max, ',')) != NULL)
+			*after++ = '\0';
+	}
+	if (!parse_duration(s, &job->backoff) || job->backoff == 0)
+		return 0;
+	job->backoff_max = job->backoff << 6;
+	if (job->backoff_max >> 6 != job->backoff)
+		job->backoff_max = ~0ULL;
+	job->backoff_after = 1;
+	if (max && (!parse_duration(max, &job->backoff_max) || job->backoff_max < job->backoff))
+		return 0;
+	if (after && (!parse_uint(after, &job->backoff_after) || job->backoff_after == 0))
+		return 0;
+	return 1;
+}
+
+/* -l<lease>[,<hold>], a lease which itself has a comma only ends in a duration if the hold is given too */
+static int parse_lease(char *s, struct job *job) {
+	char *hold;
+
+	job->lease = s;
+	job->lease_hold = 0;
+	if ((hold = strrchr(s, ',')) != NULL && parse_duration(hold + 1, &job->lease_hold)) {
+		if (job->lease_hold == 0)
+			return 0;
+		*hold = '\0';
+	}
+	return *s != '\0';
+}
+
+/* a CPU list like 0-3,8,10-11 into the mask of -a */
+static int parse_cpus(char *s, struct job *job) {
+	unsigned int first, last, bits = 8 * sizeof(job->cpus[0]);
+	size_t n;
+
+	memset(job->cpus, 0, sizeof(job->cpus));
+	do {
+		if ((n = scan_uint(s, &first)) == 0)
+			return 0;
+		s += n;
+		last = first;
+		if (*s == '-') {
+			if ((n = scan_uint(s + 1, &last)) == 0)
+				return 0;
+			s += 1 + n;
+		}
+		if (last < first || last >= CPUS_MAX)
+			return 0;
+		for (; first <= last; first++)
+			job->cpus[first / bits] |= 1UL << (first % bits);
+	} while (*s++ == ',');
+	return s[-1] == '\0';
+}
+
+/* -F<fd>[,<fd>...], only above stderr, which the children get anyway */
+static int parse_fds(char *s, struct job *job) {
+	unsigned int fd;
+	size_t n;
+
+	job->npassfds = 0;
+	do {
+		if ((n = scan_uint(s, &fd)) == 0 || fd < 3 || fd > 0x7fffffff || job->npassfds == JOB_PASSFDS)
+			return 0;
+		job->passfds[job->npassfds++] = fd;
+		s += n;
+	} while (*s++ == ',');
+	return s[-1] == '\0';
+}
+
+/* -I<class>[,<level>], the classes of ionice(1) */
+static int parse_ioprio(char *s, struct job *job) {
+	static const char *classes[] = { "realtime", "best-effort", "idle" };
+	unsigned int i, level = 4;
+	size_t n;
+
+	for (i = 0; i < 3; i++) {
+		n = strlen(classes[i]);
+		if (!strncmp(s, classes[i], n) && (s[n] == '\0' || s[n] == ','))
+			break;
+	}
+	if (i == 3)
+		return 0;
+	s += n;
+	if (*s == ',' && (!parse_uint(s + 1, &level) || level > 7))
+		return 0;
+	job->ioclass = i + 1;
+	job->iolevel = i == 2 ? 0 : level; /* idle has no levels */
+	return 1;
+}
+
+/* the inverse of parse_duration(), in the largest unit that represents the duration exactly */
+size_t fmt_duration(char *dest, unsigned long long ns) {
+	size_t n;
+
+	if (ns % NSEC_PER_SEC == 0) {
+		n = fmt_ulonglong(dest, ns / NSEC_PER_SEC);
+		n += fmt_str(dest ? dest + n : NULL, "s");
+	}
+	else if (ns % NSEC_PER_MSEC == 0) {
+		n = fmt_ulonglong(dest, ns / NSEC_PER_MSEC);
+		n += fmt_str(dest ? dest + n : NULL, "ms");
+	}
+	else if (ns % 1000 == 0) {
+		n = fmt_ulonglong(dest, ns / 1000);
+		n += fmt_str(dest ? dest + n : NULL, "us");
+	}
+	else {
+		n = fmt_ulonglong(dest, ns);
+		n += fmt_str(dest ? dest + n : NULL, "ns");
+	}
+	if (dest)
+		dest[n] = '\0';
+	return n;
+}
+
+void job_defaults(struct job *job) {
+	job->priority = 0;
+	job->splay = SPLAY_NONE;
+	job->kill_grace = KILL_TIMEOUT_CHILD;
+	job->overlap = OVERLAP_KILL;
+	job->max_running = 1;
+	job->cgfd = job->peakfd = job->exefd = job->outfd = job->leasefd = -1; /* so a job which wasn't opened can be released */
+}
+
+int parse_job_option(struct job *job, char *arg) {
+	unsigned long long size;
+	unsigned int u;
+	size_t n;
+
+	switch (arg[1]) {
+		case 'p':
+			job->childpidfile = arg + 2;
+			break;
+		case 'k':
+			if (!parse_duration(arg + 2, &job->kill_after))
+				return 1;
+			break;
+		case 'K':
+			if (!parse_duration(arg + 2, &job->kill_grace))
+				return 1;
+			break;
+		case 'n':
+			job->name = arg + 2;
+			break;
+		case 'S':
+			if (!parse_duration(arg + 2, &job->splay))
+				return 1;
+			break;
+		case 'B':
+			if (!parse_backoff(arg + 2, job))
+				return 1;
+			break;
+		case 'l':
+			if (!parse_lease(arg + 2, job))
+				return 1;
+			break;
+		case 'e': /* -e<name>=<value> or -e<name> to remove it, exec.c looks at the words again */
+			if (arg[2] == '\0' || arg[2] == '=')
+				return 1;
+			break;
+		case 'E':
+			if (arg[2] != '\0')
+				return 1;
+			job->clearenv = 1;
+			break;
+		case 'A':
+			if (arg[2] == '\0')
+				return 1;
+			job->after = arg + 2;
+			break;
+		case 'U':
+			if (!parse_catchup(arg + 2, &job->catchup))
+				return 1;
+			job->has_catchup = 1;
+			break;
+		case 'c':
+			if (!parse_size(arg + 2, &size) || size == 0 || size > 1 << 30)
+				return 1;
+			job->capture = size;
+			break;
+		case 'a':
+			if (!parse_cpus(arg + 2, job))
+				return 1;
+			job->has_cpus = 1;
+			break;
+		case 'N':
+			n = scan_int(arg + 2, &job->nice);
+			if (n == 0 || arg[2 + n] != '\0' || job->nice < -20 || job->nice > 19)
+				return 1;
+			job->has_nice = 1;
+			break;
+		case 'I':
+			if (!parse_ioprio(arg + 2, job))
+				return 1;
+			break;
+		case 'u':
+			if (!parse_uint(arg + 2, &job->cpu_max) || job->cpu_max == 0)
+				return 1;
+			break;
+		case 'm':
+			if (!parse_size(arg + 2, &job->memory_max) || job->memory_max == 0)
+				return 1;
+			break;
+		case 'O':
+			job->output = arg + 2;
+			break;
+		case 'g':
+			job->cgroup = arg + 2;
+			break;
+		case 'F':
+			if (!parse_fds(arg + 2, job))
+				return 1;
+			break;
+		case 'Z':
+			if (!parse_uint(arg + 2, &u) || u > 64)
+				return 1;
+			job->pool = u;
+			break;
+		case 'x':
+			if (arg[2] != '\0')
+				return 1;
+			job->hold_exe = 1;
+			break;
+		case 'q':
+			if (!parse_uint(arg + 2, &u) || u > 0xffff)
+				return 1;
+			job->priority = u;
+			break;
+		case 'o':
+			job->max_running = 1;
+			if (!strcmp(arg + 2, "kill"))
+				job->overlap = OVERLAP_KILL;
+			else if (!strcmp(arg + 2, "skip"))
+				job->overlap = OVERLAP_SKIP;
+			else if (!strcmp(arg + 2, "queue"))
+				job->overlap = OVERLAP_QUEUE;
+			else if (parse_uint(arg + 2, &job->max_running) && job->max_running > 0)
+				job->overlap = OVERLAP_CONCURRENT;
+			else
+				return 1;
+			break;
+		default:
+			return 1;
+	}
+	return 0;
+}
+
+int parse_job(struct job *job, char **argv) {
+	int i = 0;
+
+	while (argv[i] != NULL && argv[i][0] == '-') {
+		if (parse_job_option(job, argv[i]))
+			return 1;
+		i++;
+	}
+	job->options = argv;
+	job->noptions = i;
+
+	if (job->after) { /* runs after the other jobs, there is no interval */
+		if (argv[i] == NULL || job->lease)
+			return 1;
+	}
+	else {
+		if (argv[i] == NULL || argv[i + 1] == NULL)
+			return 1;
+		if (parse_calendar(argv[i], &job->cal))
+			job->calendar = argv[i];
+		else if (!parse_duration(argv[i], &job->interval) || job->interval == 0) /* 0 is a calendar or -A for the others */
+			return 1;
+		i++;
+	}
+
+	job->child = argv[i];
+
+	/*
+	   the remaining arguments will later be passed to the child
+	   note that job->argv[0] should be equal to job->child prior to execve(2), according to POSIX
+	   that's why we don't increment the index after the last operation
+	*/
+	job->argv = &argv[i];
+
+	if (job->name == NULL)
+		job->name = job->child;
+
+	return 0;
+}
+
+/* splits the line in place into null terminated words, quotes ("..." or '...') keep whitespace inside a word */
+static unsigned int split_line(char *line, char **words) {
+	unsigned int n = 0;
+	char *r = line, *w, quote;
+
+	while (1) {
+		while (*r == ' ' || *r == '\t' || *r == '\r')
+			r++;
+		if (*r == '\0')
+			break;
+
+		words[n++] = w = r;
+		while (*r != '\0' && *r != ' ' && *r != '\t' && *r != '\r') {
+			if (*r == '"' || *r == '\'') {
+				quote = *r++;
+				while (*r != '\0' && *r != quote)
+					*w++ = *r++;
+				if (*r != '\0')
+					r++;
+			}
+			else
+				*w++ = *r++;
+		}
+		if (*r != '\0')
+			r++;
+		*w = '\0'; /* w never runs ahead of r, so this can't overwrite the next word */
+	}
+
+	return n;
+}
+
+static void job_error(char *path, unsigned int lineno, char *msg) {
+	char num[FMT_ULONG];
+
+	buffer_puts(buffer_2, "minicron: ");
+	buffer_puts(buffer_2, path);
+	if (lineno) {
+		buffer_puts(buffer_2, ":");
+		buffer_put(buffer_2, num, fmt_uint(num, lineno));
+	}
+	buffer_puts(buffer_2, ": ");
+	buffer_puts(buffer_2, msg);
+	buffer_puts(buffer_2, "\n");
+	buffer_flush(buffer_2);
+}
+
+/*
+ * reads the job file into t, one job per line, in the same syntax as a job on the command line
+ * empty lines and lines starting with # are ignored
+ * all strings stay in one buffer holding the file and all argv arrays share one array of pointers,
+ * so apart from the strings themselves a job costs sizeof(struct job) plus one pointer per argument
+ */
+int load_jobs(char *path, struct jobtable *t) {
+	struct stat st;
+	char *p, *end, *line;
+	size_t nwords, nlines, pos;
+	unsigned int lineno, n;
+	char *err;
+	ssize_t r;
+	int fd;
+
+	memset(t, 0, sizeof(*t));
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st)) {
+		job_error(path, 0, "could not open the job file");
+		if (fd >= 0) close(fd);
+		return 1;
+	}
+
+	t->strings = malloc(st.st_size + 1);
+	for (pos = 0; t->strings && pos < (size_t)st.st_size; pos += r)
+		if ((r = read(fd, t->strings + pos, st.st_size - pos)) <= 0)
+			break;
+	close(fd);
+	if (t->strings == NULL || pos < (size_t)st.st_size) {
+		job_error(path, 0, "could not read the job file");
+		free(t->strings);
+		return 1;
+	}
+	end = t->strings + pos;
+	*end = '\0';
+
+	/* every line can hold at most one job, and every word starts after whitespace, so these are upper bounds */
+	nlines = 1;
+	nwords = 0;
+	for (p = t->strings; p < end; p++) {
+		if (*p == '\n')
+			nlines++;
+		if (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r' && (p == t->strings || p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\n' || p[-1] == '\r'))
+			nwords++;
+	}
+
+	t->job = calloc(nlines, sizeof(struct job));
+	t->argv = malloc((nwords + nlines) * sizeof(char*));
+	if (t->job == NULL || t->argv == NULL) {
+		job_error(path, 0, "out of memory");
+		goto fail;
+	}
+
+	pos = 0;
+	lineno = 0;
+	for (line = t->strings; line < end; line = p + 1) {
+		lineno++;
+		for (p = line; p < end && *p != '\n'; p++);
+		*p = '\0';
+
+		while (*line == ' ' || *line == '\t')
+			line++;
+		if (*line == '\0' || *line == '#' || *line == '\r')
+			continue;
+
+		n = split_line(line, &t->argv[pos]);
+		t->argv[pos + n] = NULL;
+		job_defaults(&t->job[t->njobs]);
+		if (parse_job(&t->job[t->njobs], &t->argv[pos])) {
+			job_error(path, lineno, "invalid job, expected [options...] interval child [arguments...] or [options...] -A<job>[,<job>...] child [arguments...], run minicron without arguments for the list of the options");
+			goto fail;
+		}
+		t->njobs++;
+		pos += n + 1;
+	}
+
+	if (t->njobs == 0) {
+		job_error(path, lineno, "no jobs in the job file");
+		goto fail;
+	}
+	if ((err = chain_link(t))) {
+		job_error(path, 0, err);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	free_jobs(t);
+	return 1;
+}
+
+void free_jobs(struct jobtable *t) {
+	free(t->job);
+	free(t->argv);
+	free(t->chain);
+	free(t->strings);
+	memset(t, 0, sizeof(*t));
+}
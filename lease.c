@@ -0,0 +1,211 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libowfat/fmt.h>
+#include <libowfat/scan.h>
+#include <string.h>
+#include <syslog.h> /* the LOG_* levels */
+#include <unistd.h>
+
+#include "minicron.h"
+
+/*
+ * with -l, a job which runs on several hosts for redundancy runs on only one of them per tick: the host which
+ * claims a run holds the lease of the job until hold after the run was due (half the time to the next run by
+ * default), and the other hosts skip their runs meanwhile - so the hosts need their clocks in sync and their
+ * runs at about the same moment, less than hold apart, like with a calendar or -S0
+ * the lease is claimed by a timer LEASE_AHEAD before the run is due, and while somebody else has the lock it is
+ * retried every LEASE_RETRY until the run is due, so the spawn only has to look at the outcome
+ * the backends are picked by the prefix of the lease, <scheme>:<argument>, anything else is a file
+ */
+#define LEASE_AHEAD (500 * NSEC_PER_MSEC) /* at most a quarter of the interval */
+#define LEASE_RETRY (20 * NSEC_PER_MSEC)
+
+/* what a claim of a backend returns */
+#define LEASE_WON 1
+#define LEASE_LOST 2 /* another host holds the lease at the time the run is due */
+#define LEASE_BUSY 3 /* another host is claiming it right now, try again */
+#define LEASE_FAILED 4
+
+struct lease_backend{
+	const char *scheme;
+	int (*open)(struct job*, const char*); /* returns 1 if the lease can't be used */
+	int (*claim)(struct job*, unsigned long long, unsigned long long); /* the run due on the wall clock, and until when it is held */
+	void (*close)(struct job*);
+};
+
+static int file_open(struct job*, const char*);
+static int file_claim(struct job*, unsigned long long, unsigned long long);
+static void file_close(struct job*);
+static void lease_claim(struct job*, unsigned long long, int);
+static void lease_timer(struct timer*, unsigned long long);
+
+static const struct lease_backend backends[] = {
+	{ "file", file_open, file_claim, file_close }, /* the first one is the default */
+};
+
+static char holder[256]; /* the hostname, written into the leases this host holds */
+
+/*
+ * the file holds one line, the expiry on the wall clock in nanoseconds and the holder - it is read and rewritten
+ * under a fcntl(2) write lock, which NFS hands to the server, and unlocking makes the client write the line back
+ * and locking makes it read it afresh - the lock is only taken with F_SETLK, so a claim never waits for it
+ * fcntl(2) locks belong to the process, the hosts have to use one file per job
+ */
+static int file_open(struct job *job, const char *path) {
+	return (job->leasefd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0;
+}
+
+static int file_claim(struct job *job, unsigned long long due, unsigned long long until) {
+	char buf[FMT_ULONG + sizeof(holder) + 2], *p;
+	unsigned long long expiry;
+	struct flock fl;
+	int r = LEASE_WON;
+	ssize_t n;
+	size_t k;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	if (fcntl(job->leasefd, F_SETLK, &fl))
+		return errno == EAGAIN || errno == EACCES ? LEASE_BUSY : LEASE_FAILED;
+
+	if ((n = pread(job->leasefd, buf, sizeof(buf) - 1, 0)) < 0)
+		r = LEASE_FAILED;
+	else {
+		buf[n] = '\0';
+		if ((k = scan_ulonglong(buf, &expiry)) && buf[k] == ' ' && expiry > due && (p = strchr(buf + k + 1, '\n'))) {
+			*p = '\0';
+			if (strcmp(buf + k + 1, holder)) /* our own lease is simply renewed */
+				r = LEASE_LOST;
+		}
+	}
+	if (r == LEASE_WON) {
+		p = buf + fmt_ulonglong(buf, until);
+		*p++ = ' ';
+		p += fmt_str(p, holder);
+		*p++ = '\n';
+		if (pwrite(job->leasefd, buf, p - buf, 0) != p - buf || ftruncate(job->leasefd, p - buf))
+			r = LEASE_FAILED;
+	}
+
+	fl.l_type = F_UNLCK;
+	fcntl(job->leasefd, F_SETLK, &fl);
+	return r;
+}
+
+static void file_close(struct job *job) {
+	close(job->leasefd);
+}
+
+/* called by job_open(), looks up the backend of the lease and opens it, returns 1 and logs if it can't */
+int lease_open(struct job *job) {
+	const char *arg = job->lease;
+	unsigned int i;
+	size_t n;
+
+	job->leasefd = -1;
+	if (job->lease == NULL)
+		return 0;
+	if (holder[0] == '\0' && (gethostname(holder, sizeof(holder) - 1) || holder[0] == '\0')) {
+		log_msg(LOG_ERR, job, 0, "Could not get the hostname for the lease of %s.", job->name);
+		return 1;
+	}
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		n = strlen(backends[i].scheme);
+		if (!strncmp(job->lease, backends[i].scheme, n) && job->lease[n] == ':') {
+			arg += n + 1;
+			break;
+		}
+	}
+	job->leaseb = &backends[i < sizeof(backends) / sizeof(backends[0]) ? i : 0];
+	if (job->leaseb->open(job, arg)) {
+		log_msg(LOG_ERR, job, 0, "Could not open the lease %s of %s.", job->lease, job->name);
+		job->leasefd = -1;
+		return 1;
+	}
+	return 0;
+}
+
+/* called by job_release() */
+void lease_close(struct job *job) {
+	if (job->lease && job->leasefd >= 0)
+		job->leaseb->close(job);
+	job->leasefd = -1;
+}
+
+/* puts the claim ahead of the next run, called whenever the run timer has been put */
+void lease_schedule(struct job *job) {
+	unsigned long long ahead = LEASE_AHEAD;
+
+	if (job->lease == NULL || !job->run.slot)
+		return;
+	if (job->interval && ahead > job->interval / 4)
+		ahead = job->interval / 4;
+	job->claim.fire = lease_timer;
+	heap_insert(&state.timers, &job->claim, job->run.when > ahead ? job->run.when - ahead : 0);
+}
+
+static void lease_timer(struct timer *t, unsigned long long now) {
+	lease_claim(TIMER_OWNER(t, struct job, claim), now, 0);
+}
+
+/* claims the lease for the next run, the last attempt is made when the run is due */
+static void lease_claim(struct job *job, unsigned long long now, int last) {
+	unsigned long long due, next, hold;
+	int prev = job->leased;
+
+	job->claimed = job->run.when;
+	job->leased = 0;
+	if (job->backoff_until > job->run.when) /* the run is skipped here anyway, another host can have it */
+		return;
+	if (job->calendar) {
+		due = job->fire;
+		next = calendar_next(&job->cal, due);
+		hold = next > due ? (next - due) / 2 : 0;
+	}
+	else {
+		due = wallclock_ns() + job->run.when - now; /* in the past for the last attempt, the run is late */
+		hold = job->interval / 2;
+	}
+	if (job->lease_hold)
+		hold = job->lease_hold;
+
+	switch ((job->leased = job->leaseb->claim(job, due, due + hold))) {
+		case LEASE_BUSY:
+			if (!last && now + LEASE_RETRY < job->run.when) {
+				job->leased = prev;
+				heap_insert(&state.timers, &job->claim, now + LEASE_RETRY);
+				return;
+			}
+			/* fallthrough */
+		case LEASE_FAILED:
+			job->leased = LEASE_FAILED;
+			job->leases.failed++;
+			log_msg(LOG_WARNING, job, 0, "Could not claim the lease %s of %s in time, skipping this run.", job->lease, job->name);
+			break;
+		case LEASE_LOST:
+			job->leases.lost++;
+			log_msg(prev == LEASE_LOST ? LOG_DEBUG : LOG_NOTICE, job, 0, "Another host holds the lease %s of %s, skipping its runs here.", job->lease, job->name);
+			break;
+		case LEASE_WON:
+			job->leases.won++;
+			log_msg(prev == LEASE_WON ? LOG_DEBUG : LOG_NOTICE, job, 0, "Holding the lease %s of %s, running it here.", job->lease, job->name);
+			break;
+	}
+}
+
+/* called by run_allowed(), whether this host runs the tick due now - the claim is made right away if the timer hasn't got to it */
+int lease_held(struct job *job, unsigned long long now) {
+	if (job->lease == NULL)
+		return 1;
+	if (job->claim.slot || job->claimed != job->run.when) {
+		heap_remove(&state.timers, &job->claim);
+		lease_claim(job, now, 1);
+	}
+	return job->leased == LEASE_WON;
+}
+
+/* called for the queued and the made up runs, which go with the last claim instead of claiming the next run early */
+int lease_kept(struct job *job) {
+	return job->lease == NULL || job->leased == LEASE_WON;
+}
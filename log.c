@@ -0,0 +1,287 @@
+#define _GNU_SOURCE /* sendmmsg(2) on Linux */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "minicron.h"
+
+#ifndef _PATH_LOG
+#define _PATH_LOG "/dev/log"
+#endif
+
+/*
+ * the log messages are formatted into a preallocated ring of records and written out by log_flush(),
+ * which the event loop calls before it goes to sleep - so logging never blocks the scheduler
+ * if a sink can't keep up, its records stay in the ring until the fd becomes writable again,
+ * and once the ring is full new messages are dropped and counted instead of waiting
+ */
+#define LOG_RECORDS 256
+#define LOG_JOB 48
+#define LOG_TEXT 400
+#define LOG_BATCH 32 /* records per sendmmsg(2) or writev(2) */
+#define LOG_LINE 1024 /* a formatted record, with room for escaping the job and the message */
+
+#define LOGFMT_SYSLOG 0
+#define LOGFMT_KV 1 /* time=... level=... job="..." pid=... msg="..." */
+#define LOGFMT_JSON 2
+
+struct logrecord{
+	unsigned long long time; /* CLOCK_REALTIME in nanoseconds */
+	int level;
+	pid_t pid; /* 0 if the message isn't about a child */
+	char job[LOG_JOB]; /* empty if the message isn't about a job */
+	char msg[LOG_TEXT];
+};
+
+struct logsink{
+	struct watcher w; /* only watched for POLLOUT while records are stuck */
+	char *path;
+	unsigned short format;
+	unsigned short dgram; /* one record per datagram, otherwise a stream of lines */
+	unsigned long long tail; /* the next record to write */
+	unsigned long long retry; /* when to reconnect a lost socket */
+};
+
+struct logstats logstats;
+
+static struct logrecord ring[LOG_RECORDS];
+static unsigned long long head; /* the next record to fill */
+static unsigned long long dropped_reported;
+static struct logsink sinks[2];
+static unsigned int nsinks;
+static pid_t logpid;
+static char line[LOG_BATCH][LOG_LINE];
+
+static int sink_connect(struct logsink*);
+static void sink_ready(struct watcher*, short);
+static void sink_flush(struct logsink*);
+static size_t escape(char*, size_t, const char*, int);
+static size_t format_record(struct logsink*, struct logrecord*, char*);
+
+static const char *level_names[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+
+static int sink_connect(struct logsink *s) {
+	struct sockaddr_un sun;
+	struct stat st;
+	int fd;
+
+	if (s->format != LOGFMT_SYSLOG && (stat(s->path, &st) || !S_ISSOCK(st.st_mode))) {
+		s->dgram = 0;
+		fd = open(s->path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK | O_CLOEXEC, 0640);
+	}
+	else {
+		s->dgram = 1;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, s->path, sizeof(sun.sun_path) - 1);
+		if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) >= 0 && connect(fd, (struct sockaddr*)&sun, sizeof(sun))) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	s->w.fd = fd;
+	return fd >= 0;
+}
+
+/*
+ * opens the sinks: syslog with -s, and the structured log of -L, which is appended to if it is a file,
+ * or which gets one datagram per record if it is a UNIX datagram socket
+ */
+void log_open() {
+	struct logsink *s;
+
+	logpid = getpid();
+	if (config.syslog) {
+		s = &sinks[nsinks++];
+		s->path = _PATH_LOG;
+		s->format = LOGFMT_SYSLOG;
+	}
+	if (config.logfile) {
+		s = &sinks[nsinks++];
+		s->path = config.logfile;
+		s->format = config.logjson ? LOGFMT_JSON : LOGFMT_KV;
+	}
+	for (s = sinks; s < sinks + nsinks; s++) {
+		s->w.ready = sink_ready;
+		s->tail = head;
+		sink_connect(s);
+	}
+}
+
+void log_msg(int level, struct job *job, pid_t pid, const char *fmt, ...) {
+	struct logrecord *r;
+	struct timespec ts;
+	unsigned int i;
+	va_list ap;
+
+	if (nsinks == 0 || (level == LOG_DEBUG && !config.verbose)) /* before a record is taken, so every tick can't crowd out the warnings */
+		return;
+	for (i = 0; i < nsinks; i++)
+		if (head - sinks[i].tail >= LOG_RECORDS) { /* the slowest sink hasn't written the oldest record yet */
+			logstats.dropped++;
+			return;
+		}
+
+	r = &ring[head % LOG_RECORDS];
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->time = (unsigned long long)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+	r->level = level;
+	r->pid = pid;
+	r->job[0] = '\0';
+	if (job) {
+		strncpy(r->job, job->name, LOG_JOB - 1);
+		r->job[LOG_JOB - 1] = '\0';
+	}
+	va_start(ap, fmt);
+	vsnprintf(r->msg, LOG_TEXT, fmt, ap);
+	va_end(ap);
+
+	head++;
+	logstats.logged++;
+}
+
+/* escapes for the quoted strings of LOGFMT_KV and LOGFMT_JSON, never writes more than n bytes */
+static size_t escape(char *dest, size_t n, const char *s, int json) {
+	static const char hex[] = "0123456789abcdef";
+	size_t i = 0;
+
+	for (; *s && i + 6 < n; s++) {
+		if (*s == '"' || *s == '\\') {
+			dest[i++] = '\\';
+			dest[i++] = *s;
+		}
+		else if ((unsigned char)*s < 0x20) {
+			if (json) {
+				memcpy(dest + i, "\\u00", 4);
+				dest[i + 4] = hex[(unsigned char)*s >> 4];
+				dest[i + 5] = hex[*s & 15];
+				i += 6;
+			}
+			else
+				dest[i++] = ' ';
+		}
+		else
+			dest[i++] = *s;
+	}
+	return i;
+}
+
+static size_t format_record(struct logsink *s, struct logrecord *r, char *dest) {
+	char stamp[32], job[LOG_JOB * 6], msg[LOG_TEXT * 6];
+	struct tm tm;
+	time_t t = r->time / NSEC_PER_SEC;
+	int level = r->level & LOG_PRIMASK, n;
+
+	if (s->format == LOGFMT_SYSLOG) {
+		localtime_r(&t, &tm);
+		strftime(stamp, sizeof(stamp), "%b %e %H:%M:%S", &tm);
+		n = snprintf(dest, LOG_LINE, "<%d>%s minicron[%d]: %s", LOG_CRON | level, stamp, (int)logpid, r->msg);
+	}
+	else {
+		gmtime_r(&t, &tm);
+		strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+		job[escape(job, sizeof(job), r->job, s->format == LOGFMT_JSON)] = '\0';
+		msg[escape(msg, sizeof(msg), r->msg, s->format == LOGFMT_JSON)] = '\0';
+		if (s->format == LOGFMT_JSON)
+			n = snprintf(dest, LOG_LINE, "{\"time\":\"%s.%03uZ\",\"level\":\"%s\",\"job\":\"%s\",\"pid\":%d,\"msg\":\"%s\"}\n",
+				stamp, (unsigned int)(r->time / NSEC_PER_MSEC % 1000), level_names[level], job, (int)r->pid, msg);
+		else
+			n = snprintf(dest, LOG_LINE, "time=%s.%03uZ level=%s job=\"%s\" pid=%d msg=\"%s\"\n",
+				stamp, (unsigned int)(r->time / NSEC_PER_MSEC % 1000), level_names[level], job, (int)r->pid, msg);
+	}
+	if (n >= LOG_LINE) { /* truncated, but keep the line terminated */
+		n = LOG_LINE - 1;
+		if (s->format != LOGFMT_SYSLOG)
+			dest[n - 1] = '\n';
+	}
+	return n;
+}
+
+static void sink_ready(struct watcher *w, short revents) {
+	(void)revents;
+	sink_flush((struct logsink*)w);
+}
+
+static void sink_flush(struct logsink *s) {
+	struct mmsghdr msgs[LOG_BATCH];
+	struct iovec iov[LOG_BATCH];
+	unsigned int n;
+	ssize_t r;
+
+	if (s->w.fd < 0) { /* the socket was lost (e.g. syslogd restarted), retry at most once a second */
+		if (monotonic_ns() >= s->retry && !sink_connect(s))
+			s->retry = monotonic_ns() + NSEC_PER_SEC;
+		if (s->w.fd < 0) {
+			logstats.lost += head - s->tail;
+			s->tail = head;
+			return;
+		}
+	}
+
+	while (s->tail < head) {
+		for (n = 0; n < LOG_BATCH && s->tail + n < head; n++) {
+			iov[n].iov_base = line[n];
+			iov[n].iov_len = format_record(s, &ring[(s->tail + n) % LOG_RECORDS], line[n]);
+			memset(&msgs[n], 0, sizeof(msgs[n]));
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+		}
+
+		r = s->dgram ? sendmmsg(s->w.fd, msgs, n, MSG_DONTWAIT) : writev(s->w.fd, iov, n);
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == EINTR)) {
+			if (!s->w.slot) { /* come back when the fd is writable */
+				s->w.events = POLLOUT;
+				watch_add(&s->w);
+			}
+			return;
+		}
+		if (r < 0) { /* the sink is gone, drop what we have and reconnect later */
+			watch_remove(&s->w);
+			close(s->w.fd);
+			s->w.fd = -1;
+			s->retry = monotonic_ns() + NSEC_PER_SEC;
+			logstats.lost += head - s->tail;
+			s->tail = head;
+			return;
+		}
+		/* a datagram sink may take only part of the batch, a short write to a file loses the rest of it */
+		n = s->dgram ? (unsigned int)r : n;
+		s->tail += n;
+		logstats.written += n;
+	}
+	watch_remove(&s->w);
+}
+
+void log_flush() {
+	unsigned int i;
+
+	for (i = 0; i < nsinks; i++)
+		sink_flush(&sinks[i]);
+
+	if (logstats.dropped > dropped_reported) {
+		log_msg(LOG_WARNING, NULL, 0, "Dropped %llu log messages, the log sinks can't keep up.", logstats.dropped - dropped_reported);
+		dropped_reported = logstats.dropped;
+	}
+}
+
+/* a last, still non-blocking, flush before exiting */
+void log_close() {
+	unsigned int i;
+
+	for (i = 0; i < nsinks; i++) {
+		sink_flush(&sinks[i]);
+		if (sinks[i].w.fd >= 0)
+			close(sinks[i].w.fd);
+	}
+	nsinks = 0;
+}
@@ -0,0 +1,485 @@
+#define _GNU_SOURCE /* accept4(2) on Linux */
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h> /* the LOG_* levels */
+#include <unistd.h>
+
+#include "minicron.h"
+
+/*
+ * the counters and histograms are plain fields updated from the main loop, which is the only thread,
+ * so recording a value is a few increments on preallocated memory - no locks, no allocations
+ * the endpoint of -M answers every HTTP request with all of them in the Prometheus text format
+ */
+#define METRICS_CLIENTS 4 /* connections served at a time, a new one closes the oldest */
+#define METRICS_REQUEST 1024 /* the most of a request we read, we only wait for its end */
+
+struct metrics_client{
+	struct watcher w;
+	unsigned long long since; /* when it connected, to find the oldest */
+	size_t reqlen; /* the request read so far, 0 once we answer */
+	char req[METRICS_REQUEST];
+	char *resp;
+	size_t resplen, respsize, sent;
+};
+
+struct metrics metrics;
+
+static struct watcher listener = { -1, POLLIN, 0, NULL };
+static struct metrics_client clients[METRICS_CLIENTS];
+static char *unix_path; /* unlinked again by metrics_close() */
+
+static void metrics_accept(struct watcher*, short);
+static void client_ready(struct watcher*, short);
+static void client_close(struct metrics_client*);
+static void render(struct metrics_client*);
+static void put(struct metrics_client*, const char*, ...) __attribute__((format(printf, 2, 3)));
+static void put_bytes(struct metrics_client*, const char*, size_t);
+static void put_seconds(struct metrics_client*, unsigned long long);
+static void put_label(struct metrics_client*, const char*);
+static void put_histogram(struct metrics_client*, const char*, const char*, struct histogram*);
+static void put_usage(struct metrics_client*, const char*, const char*, size_t, int);
+static void put_summary(struct metrics_client*, const char*, const char*, size_t, int);
+
+/*
+   log-linear buckets like HdrHistogram: every power of two between 2^HIST_MIN_SHIFT ns (about 1 us) and
+   2^HIST_MAX_SHIFT ns (about 73 minutes) is split into HIST_SUB buckets, so the error is below 25%
+   bucket 0 holds what is faster than that, the last one what is slower
+*/
+unsigned int hist_bucket(unsigned long long ns) {
+	unsigned int msb;
+
+	if (ns < 1ULL << HIST_MIN_SHIFT)
+		return 0;
+	msb = 63 - __builtin_clzll(ns);
+	if (msb >= HIST_MAX_SHIFT)
+		return HIST_BUCKETS - 1;
+	return 1 + (msb - HIST_MIN_SHIFT) * HIST_SUB + ((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* the exclusive upper bound of a bucket below HIST_BUCKETS - 1 */
+unsigned long long hist_bound(unsigned int i) {
+	unsigned int shift;
+
+	if (i == 0)
+		return 1ULL << HIST_MIN_SHIFT;
+	shift = HIST_MIN_SHIFT + (i - 1) / HIST_SUB;
+	return (unsigned long long)(HIST_SUB + 1 + (i - 1) % HIST_SUB) << (shift - HIST_SUB_BITS);
+}
+
+void hist_record(struct histogram *h, unsigned long long ns) {
+	h->bucket[hist_bucket(ns)]++;
+	h->count++;
+	h->sum += ns;
+}
+
+/* -M is a path if it contains a slash, otherwise [host]:port, all addresses if the host is empty */
+int metrics_open() {
+	struct addrinfo hints, *ai, *a;
+	struct sockaddr_un sun;
+	char host[256], *port;
+	int fd = -1, one = 1;
+
+	if (config.metrics == NULL)
+		return 0;
+
+	if (strchr(config.metrics, '/')) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(config.metrics) >= sizeof(sun.sun_path))
+			return 1;
+		strcpy(sun.sun_path, config.metrics);
+		unlink(config.metrics); /* left behind by an earlier instance */
+		if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0)
+			return 1;
+		if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) || listen(fd, METRICS_CLIENTS)) {
+			close(fd);
+			return 1;
+		}
+		unix_path = config.metrics;
+	}
+	else {
+		if ((port = strrchr(config.metrics, ':')) == NULL || (size_t)(port - config.metrics) >= sizeof(host))
+			return 1;
+		memcpy(host, config.metrics, port - config.metrics);
+		host[port - config.metrics] = '\0';
+		port++;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		if (getaddrinfo(host[0] ? host : NULL, port, &hints, &ai))
+			return 1;
+		for (a = ai; a; a = a->ai_next) {
+			if ((fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, a->ai_protocol)) < 0)
+				continue;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (!bind(fd, a->ai_addr, a->ai_addrlen) && !listen(fd, METRICS_CLIENTS))
+				break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(ai);
+		if (fd < 0)
+			return 1;
+	}
+
+	listener.fd = fd;
+	listener.ready = metrics_accept;
+	return watch_add(&listener);
+}
+
+void metrics_close() {
+	unsigned int i;
+
+	if (listener.fd < 0)
+		return;
+	for (i = 0; i < METRICS_CLIENTS; i++)
+		client_close(&clients[i]);
+	watch_remove(&listener);
+	close(listener.fd);
+	listener.fd = -1;
+	if (unix_path)
+		unlink(unix_path);
+}
+
+static void metrics_accept(struct watcher *w, short revents) {
+	struct metrics_client *c, *oldest = NULL;
+	unsigned int i;
+	int fd;
+
+	(void)revents;
+	if ((fd = accept4(w->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) < 0)
+		return;
+
+	/* a free slot, or the one which has been connected for the longest time */
+	for (i = 0; i < METRICS_CLIENTS; i++) {
+		c = &clients[i];
+		if (!c->w.slot)
+			break;
+		if (oldest == NULL || c->since < oldest->since)
+			oldest = c;
+	}
+	if (i == METRICS_CLIENTS) {
+		c = oldest;
+		client_close(c);
+	}
+
+	c->w.fd = fd;
+	c->w.events = POLLIN;
+	c->w.ready = client_ready;
+	c->since = monotonic_ns();
+	c->reqlen = 0;
+	c->resplen = c->sent = 0;
+	if (watch_add(&c->w))
+		close(fd);
+}
+
+static void client_close(struct metrics_client *c) {
+	if (!c->w.slot)
+		return;
+	watch_remove(&c->w);
+	close(c->w.fd);
+	c->w.fd = -1;
+}
+
+/* reads the request until the empty line which ends its header, then sends the response */
+static void client_ready(struct watcher *w, short revents) {
+	struct metrics_client *c = WATCHER_OWNER(w, struct metrics_client, w);
+	ssize_t r;
+
+	if (c->w.events == POLLIN) {
+		r = read(c->w.fd, c->req + c->reqlen, sizeof(c->req) - 1 - c->reqlen);
+		if (r <= 0) {
+			if (r == 0 || (errno != EAGAIN && errno != EINTR))
+				client_close(c);
+			return;
+		}
+		c->reqlen += r;
+		c->req[c->reqlen] = '\0';
+		if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n") && c->reqlen < sizeof(c->req) - 1)
+			return;
+		render(c);
+		watch_remove(&c->w);
+		c->w.events = POLLOUT;
+		if (watch_add(&c->w)) {
+			close(c->w.fd);
+			return;
+		}
+	}
+	else if (revents & (POLLERR | POLLHUP)) {
+		client_close(c);
+		return;
+	}
+
+	while (c->sent < c->resplen) {
+		r = write(c->w.fd, c->resp + c->sent, c->resplen - c->sent);
+		if (r < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				client_close(c);
+			return;
+		}
+		c->sent += r;
+	}
+	client_close(c);
+}
+
+/* appends to the response, the buffer of the client is kept and reused for the next connection */
+static void put(struct metrics_client *c, const char *fmt, ...) {
+	va_list ap;
+	size_t size;
+	char *p;
+	int n;
+
+	while (1) {
+		va_start(ap, fmt);
+		n = vsnprintf(c->resp + c->resplen, c->respsize - c->resplen, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if (c->resplen + n < c->respsize) {
+			c->resplen += n;
+			return;
+		}
+		size = c->respsize ? 2 * c->respsize : 16384;
+		while (size <= c->resplen + n)
+			size *= 2;
+		if ((p = realloc(c->resp, size)) == NULL)
+			return;
+		c->resp = p;
+		c->respsize = size;
+	}
+}
+
+static void put_seconds(struct metrics_client *c, unsigned long long ns) {
+	put(c, "%llu.%09llu", ns / NSEC_PER_SEC, ns % NSEC_PER_SEC);
+}
+
+/* a label value, with the escapes of the text format */
+/* like put(), without the formatting */
+static void put_bytes(struct metrics_client *c, const char *s, size_t n) {
+	size_t size;
+	char *p;
+
+	if (c->resplen + n >= c->respsize) {
+		size = c->respsize ? 2 * c->respsize : 16384;
+		while (size <= c->resplen + n)
+			size *= 2;
+		if ((p = realloc(c->resp, size)) == NULL)
+			return;
+		c->resp = p;
+		c->respsize = size;
+	}
+	memcpy(c->resp + c->resplen, s, n);
+	c->resplen += n;
+}
+
+/* the runs of characters which need no escaping are copied as a whole, a scrape puts out a label for every series of every job */
+static void put_label(struct metrics_client *c, const char *s) {
+	size_t n;
+
+	while (1) {
+		n = strcspn(s, "\\\"\n");
+		put_bytes(c, s, n);
+		s += n;
+		if (*s == '\0')
+			return;
+		put_bytes(c, *s == '\n' ? "\\n" : *s == '"' ? "\\\"" : "\\\\", 2);
+		s++;
+	}
+}
+
+static void put_histogram(struct metrics_client *c, const char *name, const char *help, struct histogram *h) {
+	unsigned long long cumulative = 0;
+	unsigned int i;
+
+	put(c, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		cumulative += h->bucket[i];
+		put(c, "%s_bucket{le=\"", name);
+		put_seconds(c, hist_bound(i));
+		put(c, "\"} %llu\n", cumulative);
+	}
+	put(c, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum ", name, h->count, name);
+	put_seconds(c, h->sum);
+	put(c, "\n%s_count %llu\n", name, h->count);
+}
+
+/* a counter of every job, from its usage struct, in seconds if it is in nanoseconds */
+static void put_usage(struct metrics_client *c, const char *name, const char *help, size_t field, int ns) {
+	unsigned long long v;
+	unsigned int i;
+
+	put(c, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+	for (i = 0; i < config.jobs.njobs; i++) {
+		v = *(unsigned long long*)((char*)&config.jobs.job[i].usage + field);
+		put(c, "%s{job=\"", name);
+		put_label(c, config.jobs.job[i].name);
+		put(c, "\"} ");
+		if (ns)
+			put_seconds(c, v);
+		else
+			put(c, "%llu", v);
+		put(c, "\n");
+	}
+}
+
+/* the rolling percentiles of a field of the runstats of every job */
+static void put_summary(struct metrics_client *c, const char *name, const char *help, size_t field, int ns) {
+	static const unsigned int q[] = { 500, 900, 990 };
+	static const char *quantiles[] = { "0.5", "0.9", "0.99" };
+	unsigned long long v[3];
+	unsigned int i, k, n;
+
+	put(c, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+	for (i = 0; i < config.jobs.njobs; i++) {
+		if ((n = stats_percentiles(&config.jobs.job[i], field, q, v, 3)) == 0)
+			continue;
+		for (k = 0; k < 3; k++) {
+			put(c, "%s{job=\"", name);
+			put_label(c, config.jobs.job[i].name);
+			put(c, "\",quantile=\"%s\"} ", quantiles[k]);
+			if (ns)
+				put_seconds(c, v[k]);
+			else
+				put(c, "%llu", v[k]);
+			put(c, "\n");
+		}
+		put(c, "%s_count{job=\"", name);
+		put_label(c, config.jobs.job[i].name);
+		put(c, "\"} %u\n", n);
+	}
+}
+
+static void render(struct metrics_client *c) {
+	static const char *outcomes[] = { "ok", "failed", "terminated", "killed", "unstarted" };
+	static const char *policies[] = { "killed", "skipped", "queued", "concurrent" };
+	static const char *claims[] = { "won", "lost", "failed" };
+	unsigned long long *counts, now;
+	struct job *job;
+	unsigned int i, k;
+
+	/* a failed realloc() in put() cuts the response short, which the scraper rejects */
+	c->resplen = 0;
+	put(c, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+
+	put_histogram(c, "minicron_tick_lateness_seconds", "How late the run timers fired.", &metrics.lateness);
+	put_histogram(c, "minicron_spawn_latency_seconds", "From the deadline of a run until its child has called execve(2).", &metrics.spawn);
+	put_histogram(c, "minicron_run_duration_seconds", "How long the children ran.", &metrics.duration);
+
+	put(c, "# HELP minicron_runs_total The runs which have ended, by how they ended.\n# TYPE minicron_runs_total counter\n");
+	for (i = 0; i < config.jobs.njobs; i++) {
+		job = &config.jobs.job[i];
+		counts = &job->outcomes.ok;
+		for (k = 0; k < 5; k++) {
+			put(c, "minicron_runs_total{job=\"");
+			put_label(c, job->name);
+			put(c, "\",outcome=\"%s\"} %llu\n", outcomes[k], counts[k]);
+		}
+	}
+
+	put(c, "# HELP minicron_overlaps_total How often a run was due while the previous one was still going, by what was done.\n# TYPE minicron_overlaps_total counter\n");
+	for (i = 0; i < config.jobs.njobs; i++) {
+		job = &config.jobs.job[i];
+		counts = &job->overlaps.killed;
+		for (k = 0; k < 4; k++) {
+			put(c, "minicron_overlaps_total{job=\"");
+			put_label(c, job->name);
+			put(c, "\",action=\"%s\"} %llu\n", policies[k], counts[k]);
+		}
+	}
+
+	put(c, "# HELP minicron_job_consecutive_failures The runs which failed since the last one which succeeded.\n# TYPE minicron_job_consecutive_failures gauge\n");
+	for (i = 0; i < config.jobs.njobs; i++) {
+		put(c, "minicron_job_consecutive_failures{job=\"");
+		put_label(c, config.jobs.job[i].name);
+		put(c, "\"} %u\n", config.jobs.job[i].failures);
+	}
+	put(c, "# HELP minicron_job_backoff_seconds How long -B skips the runs of the job from now on, 0 if it doesn't.\n# TYPE minicron_job_backoff_seconds gauge\n");
+	now = monotonic_ns();
+	for (i = 0; i < config.jobs.njobs; i++) {
+		put(c, "minicron_job_backoff_seconds{job=\"");
+		put_label(c, config.jobs.job[i].name);
+		put(c, "\"} ");
+		put_seconds(c, config.jobs.job[i].backoff_until > now ? config.jobs.job[i].backoff_until - now : 0);
+		put(c, "\n");
+	}
+	put(c, "# HELP minicron_backoffs_total How often -B started skipping the runs of the job.\n# TYPE minicron_backoffs_total counter\n");
+	for (i = 0; i < config.jobs.njobs; i++) {
+		put(c, "minicron_backoffs_total{job=\"");
+		put_label(c, config.jobs.job[i].name);
+		put(c, "\"} %llu\n", config.jobs.job[i].backoffs.opened);
+	}
+	put(c, "# HELP minicron_backoff_skipped_total The runs -B has skipped.\n# TYPE minicron_backoff_skipped_total counter\n");
+	for (i = 0; i < config.jobs.njobs; i++) {
+		put(c, "minicron_backoff_skipped_total{job=\"");
+		put_label(c, config.jobs.job[i].name);
+		put(c, "\"} %llu\n", config.jobs.job[i].backoffs.skipped);
+	}
+
+	put(c, "# HELP minicron_lease_claims_total The claims of the lease of -l, by whether this host got it.\n# TYPE minicron_lease_claims_total counter\n");
+	for (i = 0; i < config.jobs.njobs; i++) {
+		job = &config.jobs.job[i];
+		if (job->lease == NULL)
+			continue;
+		counts = &job->leases.won;
+		for (k = 0; k < 3; k++) {
+			put(c, "minicron_lease_claims_total{job=\"");
+			put_label(c, job->name);
+			put(c, "\",result=\"%s\"} %llu\n", claims[k], counts[k]);
+		}
+	}
+
+	put(c, "# HELP minicron_chain_runs_total The runs of a job of -A its predecessors started, and how often it was ready again before it had started.\n# TYPE minicron_chain_runs_total counter\n");
+	for (i = 0; i < config.jobs.njobs; i++) {
+		job = &config.jobs.job[i];
+		if (job->after == NULL)
+			continue;
+		put(c, "minicron_chain_runs_total{job=\"");
+		put_label(c, job->name);
+		put(c, "\",result=\"started\"} %llu\n", job->chained.triggered);
+		put(c, "minicron_chain_runs_total{job=\"");
+		put_label(c, job->name);
+		put(c, "\",result=\"coalesced\"} %llu\n", job->chained.coalesced);
+	}
+
+	put_summary(c, "minicron_job_duration_seconds", "How long the last runs of the job took.", offsetof(struct runstat, duration), 1);
+	put_summary(c, "minicron_job_cpu_seconds", "The user and sys CPU time of the last runs of the job.", offsetof(struct runstat, cpu), 1);
+	put_summary(c, "minicron_job_max_rss_bytes", "The maximum resident set size of the last runs of the job.", offsetof(struct runstat, maxrss), 0);
+	put_usage(c, "minicron_job_user_seconds_total", "The user CPU time of all runs.", offsetof(struct job, usage.utime) - offsetof(struct job, usage), 1);
+	put_usage(c, "minicron_job_sys_seconds_total", "The sys CPU time of all runs.", offsetof(struct job, usage.stime) - offsetof(struct job, usage), 1);
+	put_usage(c, "minicron_job_blocks_in_total", "The blocks read by all runs.", offsetof(struct job, usage.inblock) - offsetof(struct job, usage), 0);
+	put_usage(c, "minicron_job_blocks_out_total", "The blocks written by all runs.", offsetof(struct job, usage.oublock) - offsetof(struct job, usage), 0);
+	put_usage(c, "minicron_job_voluntary_context_switches_total", "The voluntary context switches of all runs.", offsetof(struct job, usage.nvcsw) - offsetof(struct job, usage), 0);
+	put_usage(c, "minicron_job_involuntary_context_switches_total", "The involuntary context switches of all runs.", offsetof(struct job, usage.nivcsw) - offsetof(struct job, usage), 0);
+	put_usage(c, "minicron_job_cgroup_cpu_seconds_total", "The CPU time the cgroup of -g has counted during the runs.", offsetof(struct job, usage.cg_cpu) - offsetof(struct job, usage), 1);
+	put_usage(c, "minicron_job_cgroup_read_bytes_total", "The bytes the cgroup of -g has read during the runs.", offsetof(struct job, usage.cg_rbytes) - offsetof(struct job, usage), 0);
+	put_usage(c, "minicron_job_cgroup_written_bytes_total", "The bytes the cgroup of -g has written during the runs.", offsetof(struct job, usage.cg_wbytes) - offsetof(struct job, usage), 0);
+
+	put(c, "# HELP minicron_running The children running now.\n# TYPE minicron_running gauge\n");
+	for (i = 0; i < config.jobs.njobs; i++) {
+		put(c, "minicron_running{job=\"");
+		put_label(c, config.jobs.job[i].name);
+		put(c, "\"} %u\n", config.jobs.job[i].running);
+	}
+
+	put(c, "# HELP minicron_spawn_failures_total The runs which could not be started.\n# TYPE minicron_spawn_failures_total counter\nminicron_spawn_failures_total %llu\n", metrics.spawn_failures);
+	put(c, "# HELP minicron_admission_waiting The runs waiting for -C or -R.\n# TYPE minicron_admission_waiting gauge\nminicron_admission_waiting %u\n", state.admission.n);
+	put(c, "# HELP minicron_admission_waited_total The runs which had to wait for -C or -R.\n# TYPE minicron_admission_waited_total counter\nminicron_admission_waited_total %llu\n", state.admission_stats.waited);
+	put(c, "# HELP minicron_admission_wait_seconds_total How long the runs waited for -C or -R.\n# TYPE minicron_admission_wait_seconds_total counter\nminicron_admission_wait_seconds_total ");
+	put_seconds(c, state.admission_stats.wait_total);
+	put(c, "\n# HELP minicron_admission_wait_seconds_max The longest a run has waited for -C or -R.\n# TYPE minicron_admission_wait_seconds_max gauge\nminicron_admission_wait_seconds_max ");
+	put_seconds(c, state.admission_stats.wait_max);
+	put(c, "\n# HELP minicron_admission_queue_depth_max The most runs which have waited for -C or -R at a time.\n# TYPE minicron_admission_queue_depth_max gauge\nminicron_admission_queue_depth_max %u\n", state.admission_stats.depth_max);
+	put(c, "# HELP minicron_log_messages_total The log messages, by what became of them.\n# TYPE minicron_log_messages_total counter\n");
+	put(c, "minicron_log_messages_total{result=\"written\"} %llu\n", logstats.written);
+	put(c, "minicron_log_messages_total{result=\"dropped\"} %llu\n", logstats.dropped);
+	put(c, "minicron_log_messages_total{result=\"lost\"} %llu\n", logstats.lost);
+}
@@ -1,59 +1,32 @@
 #include <fcntl.h>
+#include <limits.h>
 #include <libowfat/buffer.h>
 #include <libowfat/fmt.h>
 #include <libowfat/scan.h>
 #include <signal.h>
+#include <stdio.h> /* rename(2) */
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC 4 /* linux/close_range.h */
+#endif
+#endif
 
-/* 
- * the following constants control the behavior of kill_pid() - they serve as second argument
- * after we send SIGTERM to a process, we wait some time before sending SIGKILL
- * the supervisor will wait KILL_TIMEOUT_CHILD seconds for the child to die after SIGTERM
- * the main loop will wait KILL_TIMEOUT_SUPERVISOR seconds for the supervisor to die after SIGTERM 
- * if we have 0 here, we won't send SIGKILL at all (not recommended for KILL_TIMEOUT_CHILD)
- */
-#define KILL_TIMEOUT_SUPERVISOR 0 /* the supervisor catches SIGTERM and invokes kill_pid() on its own, so setting null here should be safe */
-#define KILL_TIMEOUT_CHILD 3
+#include "minicron.h"
 
-/* the global struct which holds the minicron config */
-static struct minicron_config{
-	char *childpidfile;
-	char *daemonpidfile;
-	unsigned int kill_after;
-	unsigned int interval;
-	unsigned short daemon;
-	unsigned short syslog;
-	char *child;
-	char **argv; /* terminated with null pointer */
-} config;
+struct minicron_config config;
 
-/* the state struct holds a few global variables, which we can't or don't want to pass as arguments */
-struct minicron_state{
-	pid_t pid_child;
-	pid_t pid_supervisor;
-} state;
-
-void usage(char *);
-int parse_args(int, char**);
-void kill_pid(pid_t, unsigned int);
-void daemonize();
-void mainloop_sigtermhandler();
-void mainloop();
-void supervisor_sigchldhandler();
-void supervisor_sigtermhandler();
-void createpid(char*, pid_t);
-void deletepid(char*);
-int supervisor();
-int child();
-
-extern char **environ;
+static int collect_passfds();
+static int cmp_int(const void*, const void*);
+static void close_range_compat(unsigned int, unsigned int, int);
 
 int main(int argc, char **argv) {
+	char interval[FMT_DURATION];
 	int retval;
 	
 	if ((retval = parse_args(argc, argv))) {
@@ -61,13 +34,21 @@ int main(int argc, char **argv) {
 		return retval;
 	}
 	
-	if (config.syslog) {
-		openlog("minicron", LOG_PID, LOG_CRON);
-		syslog(LOG_NOTICE, "Started the daemon. Running %s every %d seconds.", config.child, config.interval);
-	}
-	
 	if (config.daemon)
 		daemonize();
+	else
+		close_fds(3, 1); /* what we were started with isn't for our children, except for the fds of -F */
+	
+	/* daemonize() closes all fds, so the log sinks are opened afterwards */
+	log_open();
+	if (config.jobfile)
+		log_msg(LOG_NOTICE, NULL, 0, "Started the daemon. Running %u jobs from %s.", config.jobs.njobs, config.jobfile);
+	else if (config.jobs.job[0].calendar)
+		log_msg(LOG_NOTICE, NULL, 0, "Started the daemon. Running %s at %s.", config.jobs.job[0].child, config.jobs.job[0].calendar);
+	else {
+		fmt_duration(interval, config.jobs.job[0].interval);
+		log_msg(LOG_NOTICE, NULL, 0, "Started the daemon. Running %s every %s.", config.jobs.job[0].child, interval);
+	}
 	
 	mainloop();
 	
@@ -78,37 +59,80 @@ int main(int argc, char **argv) {
 void usage(char *progname) {
 	buffer_puts(buffer_2, "usage: ");
 	buffer_puts(buffer_2, progname);
-	buffer_puts(buffer_2, "[-p<pidfile>] [-P<pidfile>] [-k<N>] [-d] [-s] nseconds child [arguments...]\n\
-Runs the child with the specified arguments every nseconds.\n\
+	buffer_puts(buffer_2, " [-p<pidfile>] [-P<pidfile>] [-k<duration>] [-K<duration>] [-o<policy>] [-q<priority>] [-c<size>] [-O<output>] [-g<cgroup>] [-u<percent>] [-m<size>]\n\
+       [-a<cpus>] [-N<nice>] [-I<class>[,<level>]] [-F<fd>[,<fd>...]] [-x] [-Z<N>] [-B<duration>[,<max>[,<N>]]] [-U<policy>] [-l<lease>[,<hold>]] [-E] [-e<name>[=<value>]] [-n<name>] [-S<duration>] [-C<N>] [-R<N>[,<burst>]] [-M<address>] [-X<socket>] [-T<file>] [-H<file>] [-d] [-s] [-L<log>] [-j] [-v]\n\
+       interval child [arguments...]\n");
+	buffer_puts(buffer_2, "       ");
+	buffer_puts(buffer_2, progname);
+	buffer_puts(buffer_2, " [-P<pidfile>] [-S<duration>] [-C<N>] [-R<N>[,<burst>]] [-M<address>] [-X<socket>] [-T<file>] [-H<file>] [-U<policy>] [-d] [-s] [-L<log>] [-j] [-v] -f<jobfile>\n\
+Runs the child with the specified arguments every interval.\n\
+Durations are given in seconds or with a unit: 1.5s, 250ms, 100us, 5m, 1h.\n\
+Instead of the interval a cron expression in local time can be given as one argument, like \"15 3 * * *\" (minute hour day month weekday,\n\
+with *, lists, ranges, steps and the names jan-dec and sun-sat), or one of @hourly, @daily, @weekly, @monthly and @yearly.\n\
 The following options are available:\n\
 -p<pidfile> - save the child PID in pidfile\n\
 -P<pidfile> - save the daemon PID in pidfile\n\
--k<N> - kill the child after N seconds\n\
+-T<file> - keep the list of the running children of all jobs in file, one line with the PID, the job and the start time each\n\
+-H<file> - keep when every job last ran, how it ended and when it is due next in file, so a restart continues the schedule\n\
+-U<policy> - which of the runs missed while stopped or suspended are made up: one (once, the default), all of them (all),\n\
+             none (skip) or up to N (N)\n\
+-k<duration> - kill the child after duration\n\
+-K<duration> - wait duration between SIGTERM and SIGKILL (default 3s)\n\
+-o<policy> - when a run is due while the previous one is still running: kill it first (kill, the default),\n\
+             skip the run (skip), run once it has ended (queue) or run up to N children at a time (N)\n\
+-q<priority> - the runs with higher priority leave the admission queue of -C and -R first (default 0)\n\
+-c<size> - keep the last size bytes (or 64k, 1M) of the stdout and stderr of the child, and log its last lines if it fails\n\
+-O<output> - forward the stdout and stderr of the child to output, a file or a UNIX stream socket\n\
+-g<cgroup> - move the children into the cgroup v2 directory cgroup (created if needed) and log what it used per run\n\
+-u<percent> - limit the cgroup of -g to percent of one CPU (cpu.max)\n\
+-m<size> - limit the memory of the cgroup of -g to size (memory.max)\n\
+-a<cpus> - run the children on the CPUs cpus only, like 0-3,8\n\
+-N<nice> - run the children with the nice level nice\n\
+-I<class>[,<level>] - run the children with the I/O priority class realtime, best-effort or idle, level 0-7 (default 4)\n\
+-F<fd>[,<fd>...] - pass the fds, which minicron was started with, on to the children, all other fds are closed for them\n\
+-x - open the child at startup and execute that file on every run, even if the path is replaced later\n\
+-Z<N> - keep N helpers forked and set up ahead of the runs, which then only have to exec the child\n\
+-B<duration>[,<max>[,<N>]] - after N runs in a row have failed (default 1), skip the runs for about duration,\n\
+             twice as long after every further failure up to max (default 64 times duration), until a run succeeds\n\
+-l<lease>[,<hold>] - of the hosts sharing lease, a file on a filesystem they all mount, only one runs each tick: it holds the lease\n\
+             until hold (default half the time to the next run) after the run was due, the others skip their runs meanwhile,\n\
+             so their runs have to be less than hold apart (a calendar, or -S0), and the missed runs aren't made up\n\
+-E - start the children with an empty environment instead of the one minicron was started with\n\
+-e<name>[=<value>] - set the environment variable name of the children to value, or remove it without one (may be repeated)\n\
+-n<name> - name the job in the log messages (defaults to the child)\n\
 -d - daemonize after starting\n\
--s - send messages to syslog\n");
+-s - send messages to syslog\n\
+-L<log> - also write the messages as key=value records to log, a file or a UNIX datagram socket\n\
+-j - write the records of -L as JSON\n\
+-v - also log the debug messages, like how late every tick was\n\
+-S<duration> - run on the wall clock interval boundaries, shifted by a phase offset below duration which is derived\n\
+               from the hostname and the job name, instead of right after starting (the jobs may also set their own -S)\n\
+-C<N> - run at most N children of all jobs at a time, the other runs wait in the admission queue\n\
+-R<N>[,<burst>] - start at most N children per second, with bursts of up to burst children (default N)\n\
+-M<address> - serve the metrics in the Prometheus text format over HTTP on a UNIX socket (a path) or on [host]:port\n\
+-X<socket> - take commands on the UNIX socket socket, one per line: list [<job>...], run, pause or resume <job>...,\n\
+             and interval <duration> <job>... to change the interval until a reload changes the job\n\
+-f<jobfile> - run all jobs from jobfile, one per line: [-p<pidfile>] [-k<duration>] [-K<duration>] [-o<policy>] [-q<priority>] [-c<size>] [-O<output>] [-g<cgroup>] [-u<percent>] [-m<size>] [-a<cpus>] [-N<nice>] [-I<class>[,<level>]] [-F<fd>[,<fd>...]] [-x] [-Z<N>] [-B<duration>[,<max>[,<N>]]] [-U<policy>] [-l<lease>[,<hold>]] [-E] [-e<name>[=<value>]] [-S<duration>] [-n<name>] interval child [arguments...]\n\
+              or instead of the interval -A<job>[,<job>...] to run the child once all of the named jobs have succeeded since its last run\n\
+              SIGHUP reloads jobfile, the unchanged jobs keep their schedule and their children\n");
 	buffer_flush(buffer_2);
 }
 
 int parse_args(int argc, char **argv) {
+	static struct job cmdline_job;
+	size_t n;
 	int i;
-	if (argc < 3)
+	if (argc < 2)
 		return 11;
 		
+	job_defaults(&cmdline_job);
+	config.splay = SPLAY_NONE;
+	config.catchup = 1;
 	i = 1;
-	while (argv[i][0] == '-') {
-		argv[i]++;
-		switch (argv[i][0]) {
-			case 'p':
-				argv[i]++;
-				config.childpidfile = argv[i];
-				break;
+	while (argv[i] != NULL && argv[i][0] == '-') {
+		switch (argv[i][1]) {
 			case 'P':
-				argv[i]++;
-				config.daemonpidfile = argv[i];
-				break;
-			case 'k':
-				argv[i]++;
-				scan_uint(argv[i], &config.kill_after);
+				config.daemonpidfile = argv[i] + 2;
 				break;
 			case 'd':
 				config.daemon = 1;
@@ -116,58 +140,143 @@ int parse_args(int argc, char **argv) {
 			case 's':
 				config.syslog = 1;
 				break;
-			default:
+			case 'L':
+				config.logfile = argv[i] + 2;
+				break;
+			case 'j':
+				config.logjson = 1;
+				break;
+			case 'v':
+				config.verbose = 1;
+				break;
+			case 'M':
+				config.metrics = argv[i] + 2;
+				break;
+			case 'X':
+				config.control = argv[i] + 2;
+				break;
+			case 'T':
+				config.statefile = argv[i] + 2;
+				break;
+			case 'H':
+				config.schedfile = argv[i] + 2;
+				break;
+			case 'U': /* the default of all jobs, like -S */
+				if (!parse_catchup(argv[i] + 2, &config.catchup))
+					return 12;
+				break;
+			case 'f':
+				config.jobfile = argv[i] + 2;
+				break;
+			case 'A': /* there are no other jobs to run after */
 				return 12;
+			case 'S': /* the default of all jobs, so it also applies to the command line job */
+				if (!parse_duration(argv[i] + 2, &config.splay))
+					return 12;
+				break;
+			case 'C':
+				n = scan_uint(argv[i] + 2, &config.max_children);
+				if (n == 0 || argv[i][2 + n] != '\0')
+					return 12;
+				break;
+			case 'R':
+				n = scan_uint(argv[i] + 2, &config.spawn_rate);
+				config.spawn_burst = config.spawn_rate;
+				if (n > 0 && argv[i][2 + n] == ',')
+					n += 1 + scan_uint(argv[i] + 3 + n, &config.spawn_burst);
+				if (n == 0 || argv[i][2 + n] != '\0' || config.spawn_burst == 0)
+					return 12;
+				break;
+			default: /* the options of the command line job */
+				if (parse_job_option(&cmdline_job, argv[i]))
+					return 12;
 		}
 		i++;
 	}
 	
-	scan_uint(argv[i], &config.interval);
-	i++;
-	
-	config.child = argv[i];
-	
-	/* 
-	   the remaining arguments will later be passed to the child
-	   note that config.argv[0] should be equal to config.child prior to execve(2), according to POSIX
-	   that's why we don't increment the index after the last operation 
-	*/
-	if (argv[i] != NULL)
-		config.argv = &argv[i];
+	if (config.jobfile) {
+		if (argv[i] != NULL) /* either a job file or a job on the command line, not both */
+			return 13;
+		if (load_jobs(config.jobfile, &config.jobs))
+			return 14;
+	}
+	else {
+		if (parse_job(&cmdline_job, &argv[i]))
+			return 11;
+		cmdline_job.options = &argv[1]; /* mixed with the global ones, which -e doesn't clash with */
+		cmdline_job.noptions = i - 1;
+		config.jobs.job = &cmdline_job;
+		config.jobs.njobs = 1;
+	}
 	
-	return 0;
+	return collect_passfds() ? 15 : 0;
 }
 
-void kill_pid(pid_t pid, unsigned int timeout) {
-	int state = 0, waitpid_r = 0;
-	
-	waitpid_r = waitpid(pid, &state, WNOHANG); /* check the child state */
-	
-	if (!(WIFEXITED(state) || WIFSIGNALED(state)) || waitpid_r==0) { /* the child has not exited yet */
-		if (config.syslog) syslog(LOG_NOTICE, "Sending SIGTERM to PID %d.", pid);
-		kill(pid, SIGTERM); /* sending SIGTERM to child */
-	}
-	else 
-		return;
-	
-	if (timeout>0) {
-	/* the child may ignore the SIGTERM, so we wait and check again */
-		waitpid_r = waitpid(pid, &state, WNOHANG);
-		if (!(WIFEXITED(state) || WIFSIGNALED(state)) || waitpid_r==0) /* check again before sleeping, in order to avoid useless blocking */
-			sleep(timeout); 
-		else 
-			return;
+static int cmp_int(const void *a, const void *b) {
+	return *(const int*)a - *(const int*)b;
+}
 
-		waitpid_r = waitpid(pid, &state, WNOHANG);
-	
-		if (!(WIFEXITED(state) || WIFSIGNALED(state)) || waitpid_r==0) {
-			if (config.syslog) syslog(LOG_NOTICE, "Sending SIGKILL to PID %d.", pid);
-			kill(pid, SIGKILL); /* finally send SIGKILL */
+/* the fds of -F of all jobs, sorted and without duplicates, they have to be open already */
+static int collect_passfds() {
+	unsigned int i, k, n = 0;
+
+	for (i = 0; i < config.jobs.njobs; i++)
+		n += config.jobs.job[i].npassfds;
+	if (n == 0)
+		return 0;
+	if ((config.passfds = malloc(n * sizeof(int))) == NULL)
+		return 1;
+	for (i = n = 0; i < config.jobs.njobs; i++)
+		for (k = 0; k < config.jobs.job[i].npassfds; k++)
+			config.passfds[n++] = config.jobs.job[i].passfds[k];
+	qsort(config.passfds, n, sizeof(int), cmp_int);
+	for (i = k = 0; i < n; i++)
+		if (k == 0 || config.passfds[k - 1] != config.passfds[i])
+			config.passfds[k++] = config.passfds[i];
+	config.npassfds = k;
+
+	for (i = 0; i < config.npassfds; i++)
+		if (fcntl(config.passfds[i], F_GETFD) < 0) {
+			buffer_puts(buffer_2, "minicron: -F names an fd which isn't open\n");
+			buffer_flush(buffer_2);
+			return 1;
 		}
+	return 0;
+}
+
+/* close_range(2) on Linux, closefrom(2) on the BSDs, and the loop over the whole fd table everywhere else */
+static void close_range_compat(unsigned int first, unsigned int last, int cloexec) {
+	unsigned int fd, max;
+
+#if defined(__linux__) && defined(SYS_close_range)
+	if (syscall(SYS_close_range, first, last, cloexec ? CLOSE_RANGE_CLOEXEC : 0) == 0)
+		return;
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
+	if (!cloexec && last == ~0U) {
+		closefrom(first);
+		return;
+	}
+#endif
+	max = getdtablesize();
+	for (fd = first; fd <= last && fd < max; fd++)
+		if (cloexec)
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
 		else
-			return;
-	} else /* timeout == 0, wait the process to die */
-		waitpid(pid, &state, 0);
+			close(fd);
+}
+
+/* closes, or marks close-on-exec, every fd from lowfd on, except the ones passed to the children with -F */
+void close_fds(int lowfd, int cloexec) {
+	unsigned int i, from = lowfd;
+
+	for (i = 0; i < config.npassfds; i++) {
+		if ((unsigned int)config.passfds[i] < from)
+			continue;
+		if ((unsigned int)config.passfds[i] > from)
+			close_range_compat(from, config.passfds[i] - 1, cloexec);
+		from = config.passfds[i] + 1;
+	}
+	close_range_compat(from, ~0U, cloexec);
 }
 
 void daemonize() {
@@ -192,8 +301,7 @@ void daemonize() {
 	signal(SIGCHLD, SIG_IGN);
 		
 	/* close all fds */
-	for (fd=0; fd<getdtablesize(); fd++)
-		close(fd);
+	close_fds(0, 0);
 		
 	/* reopen the basic fds and redirect them to /dev/null */
 	fd = open("/dev/null", O_RDWR);
@@ -202,70 +310,45 @@ void daemonize() {
 	dup2(fd, STDERR_FILENO);
 }
 
-void mainloop_sigtermhandler() {
-	kill_pid(state.pid_supervisor, KILL_TIMEOUT_SUPERVISOR);
-	deletepid(config.daemonpidfile);
-	if(config.syslog) {
-		syslog(LOG_NOTICE, "Stopping after receiving SIGTERM.");
-		closelog();
-	}
-	exit(1);
-}
+/*
+   writes the file under a temporary name next to it and renames it over the file, so a reader sees the
+   old or the new content but never a part of it - returns 1 on failure, the file is left as it was
+*/
+int write_atomic(char *path, const char *buf, size_t len, mode_t mode) {
+	char tmp[PATH_MAX];
+	size_t n = strlen(path);
+	int fd;
 
-void mainloop() {
-	createpid(config.daemonpidfile, getpid());
-	
-	signal(SIGTERM, mainloop_sigtermhandler);
-	signal(SIGINT, SIG_IGN); /* ignoring SIGINT */
-	
-	while (1) {
-		state.pid_supervisor = fork();
-		if (state.pid_supervisor < 0) /* fork failed */
-			continue;
-		else if (state.pid_supervisor == 0)
-			supervisor();
+	if (n + sizeof(".tmp") > sizeof(tmp))
+		return 1;
+	memcpy(tmp, path, n);
+	memcpy(tmp + n, ".tmp", sizeof(".tmp"));
 
-		sleep(config.interval);
-		
-		kill_pid(state.pid_supervisor, KILL_TIMEOUT_SUPERVISOR);
+	/* a left over temporary file may not be writable, like a pidfile with S_IRUSR */
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode)) < 0 && (unlink(tmp) || (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode)) < 0))
+		return 1;
+	if (write(fd, buf, len) != (ssize_t)len) {
+		close(fd);
+		unlink(tmp);
+		return 1;
 	}
+	if (close(fd) || rename(tmp, path)) {
+		unlink(tmp);
+		return 1;
+	}
+	return 0;
 }
 
-void supervisor_sigchldhandler() {
-	if (config.syslog) syslog(LOG_NOTICE, "The child %s (PID %d) has ended.", config.child, state.pid_child);
-	deletepid(config.childpidfile);
-	_exit(0);
-}
-
-void supervisor_sigtermhandler() {
-	kill_pid(state.pid_child, KILL_TIMEOUT_CHILD);
-	if (config.syslog) syslog(LOG_NOTICE, "The child %s (PID %d) has ended.", config.child, state.pid_child);
-	deletepid(config.childpidfile);
-	_exit(1);
-}
-
+/* called for every child start, so the PID is formatted on the stack */
 void createpid(char *pidfile, pid_t pid) {
-	char *p, *buf;
-	int fd;
+	char buf[FMT_ULONG + 1];
+	size_t n;
+
 	if (pidfile == NULL)
 		return;
-		
-	/* check if the pidfile already exists, try to delete it and return on failure */
-	if (!access(pidfile, F_OK))
-		if (unlink(pidfile))
-			return;
-			
-	p = buf = malloc(sizeof(char) * 8);
-	p += fmt_uint(p, pid);
-	p += fmt_str(p, "\n\0");
-	
-	fd = creat(pidfile, S_IRUSR); 
-	
-	write(fd, buf, strlen(buf));
-	
-	close(fd);
-	
-	free(buf);
+	n = fmt_ulong(buf, pid);
+	buf[n++] = '\n';
+	write_atomic(pidfile, buf, n, S_IRUSR);
 }
 
 void deletepid(char *pidfile) {
@@ -273,43 +356,3 @@ void deletepid(char *pidfile) {
 		return;
 	unlink(pidfile);
 }
-
-int supervisor() {
-	signal(SIGTERM, supervisor_sigtermhandler); /* catch SIGTERM from the parent, if the interval has passed */
-	signal(SIGCHLD, supervisor_sigchldhandler); /* catch SIGCHLD in order to _exit(2) immediately after the child returns */
-	
-	state.pid_child = vfork();
-	if (state.pid_child < 0) /* fork failed */
-		_exit(-1);
-	else if (state.pid_child == 0)
-		child();
-		
-	createpid(config.childpidfile, state.pid_child);
-	// atexit(deletepid); /* won't work if the supervisor is killed by a signal! */
-		
-	if (config.syslog) {
-		if (config.kill_after) {
-			if (config.syslog) syslog(LOG_NOTICE, "Started %s (PID %d). Will wait %d seconds before killing it.", config.child, state.pid_child, config.kill_after);
-		}
-		else {
-			if (config.syslog) syslog(LOG_NOTICE, "Started %s (PID %d).", config.child, state.pid_child);
-		}
-	}
-	
-	if (config.kill_after) {
-		sleep(config.kill_after);
-		kill_pid(state.pid_child, KILL_TIMEOUT_CHILD);
-	} else
-		wait(0);
-	
-	if (config.syslog) syslog(LOG_NOTICE, "The child %s (PID %d) has ended.", config.child, state.pid_child);
-	deletepid(config.childpidfile);
-		
-	_exit(0);
-}
-
-int child() {
-	execve(config.child, config.argv, environ);
-	/* execve(2) returns only on error, so if we reached this point, something is not OK */
-	_exit(-1); 
-}
@@ -0,0 +1,501 @@
+#ifndef MINICRON_H
+#define MINICRON_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "heap.h"
+
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+/*
+ * the following constant is the default of -K, the grace kill_pid() gives a child after SIGTERM
+ * once KILL_TIMEOUT_CHILD nanoseconds have passed without the child exiting, kill_timer() sends SIGKILL
+ * if we have 0 here (or -K0), we won't send SIGKILL at all (not recommended)
+ */
+#define KILL_TIMEOUT_CHILD (3 * NSEC_PER_SEC)
+
+#define JOB_PASSFDS 16 /* the most fds -F can pass to the children of a job */
+#define JOB_AFTER 16 /* the most jobs -A can name */
+#define CPUS_MAX 1024 /* the CPUs -a can name, the size of cpu_set_t */
+#define FMT_DURATION 24 /* enough for fmt_duration() of any unsigned long long */
+#define SPLAY_NONE (~0ULL) /* without -S the first run starts right away */
+#define CATCHUP_ALL (~0U) /* -Uall, every missed run is made up */
+
+/* what run_job() does when a run is due while the previous one is still going, -o */
+#define OVERLAP_KILL 0 /* kill the running child first, the default */
+#define OVERLAP_SKIP 1 /* don't run this time */
+#define OVERLAP_QUEUE 2 /* run as soon as the running child has ended, at most one run waits */
+#define OVERLAP_CONCURRENT 3 /* run alongside, up to max_running children at a time, skip beyond that */
+
+struct job;
+struct lease_backend;
+struct rusage;
+
+/* the counters of a cgroup v2, see stats.c */
+struct cgstat{
+	unsigned long long cpu; /* nanoseconds */
+	unsigned long long rbytes, wbytes;
+	unsigned long long memory_peak;
+};
+
+/* what a run used, the last RUN_WINDOW runs of every job are kept for the percentiles of the metrics */
+#define RUN_WINDOW 64
+struct runstat{
+	unsigned long long duration; /* nanoseconds */
+	unsigned long long cpu; /* user and sys, nanoseconds */
+	unsigned long long maxrss; /* bytes */
+};
+
+/* a cron expression compiled into bit masks, see calendar.c */
+#define CAL_MDAY 1 /* the day of the month is restricted */
+#define CAL_WDAY 2 /* the weekday is */
+struct calendar{
+	unsigned long long minutes; /* bit n for minute n */
+	unsigned int hours;
+	unsigned int mdays; /* bit n for day n of the month */
+	unsigned int wdays[7]; /* the days of a month starting on a Sunday, Monday, ... which are on the weekdays */
+	unsigned short months; /* bit n for month n, 1 is January */
+	unsigned short dayrule; /* CAL_MDAY and CAL_WDAY */
+};
+
+/* a record of the schedule file of -H, see persist.c - the times are on the wall clock, in nanoseconds */
+struct schedrec{
+	unsigned long long hash; /* of the job name */
+	char name[40]; /* the start of it, not null terminated if it is longer */
+	unsigned long long last_run; /* 0 if the job hasn't run yet */
+	unsigned long long last_end;
+	unsigned long long next_due;
+	int last_status; /* the wait(2) status of the last run, -1 if it couldn't be executed */
+	unsigned int unused;
+};
+
+/* an fd the event loop waits on, ready() is called from wait_event() with the revents of ppoll(2) */
+struct watcher{
+	int fd;
+	short events;
+	unsigned int slot; /* 1-based position in state.pollfds, 0 when not watched */
+	void (*ready)(struct watcher*, short);
+};
+
+/* a running child, the slots are preallocated for the maximum number of children of all jobs */
+struct proc{
+	struct job *job;
+	struct proc *next; /* the next child of the same job, or the next free slot */
+	struct timer kill; /* the -k deadline, and after SIGTERM the SIGKILL deadline */
+	struct watcher out; /* the read end of the stdout and stderr pipe of -c and -O, fd -1 without one */
+	int outw; /* the write end, only open between output_start() and vfork(2) */
+	unsigned long long outstart; /* job->outhead when the child started, its output comes after that */
+	unsigned long long started; /* for the run duration of the metrics */
+	int signalled; /* the last signal kill_pid() sent, to tell the outcomes apart */
+	struct watcher pidfd; /* on Linux, readable once the child has exited, fd -1 without one */
+	unsigned short tracked; /* track.c gets notified when the child exits, otherwise reap_children() has to find it */
+	struct proc *hnext; /* the next child in the same bucket of the PID hash */
+	struct cgstat cg; /* the counters of the cgroup of the job when the child started */
+	struct watcher exec; /* the read end of the pipe the child reports a failed execve(2) through, see exec.c */
+	int execw; /* its write end, only open until vfork(2) or fork(2) of a helper of -Z return */
+	unsigned long long due; /* the deadline of the run, for the spawn latency */
+	unsigned short execfailed; /* it did, so the run is counted as unstarted */
+	unsigned short spare; /* a helper of -Z waiting for its run, not on job->procs */
+	int go; /* the pipe a helper waits on, the write end in the parent and the read end in the helper */
+	pid_t pid; /* reset to 0 by reap_children() once it has been waited for */
+};
+#define NO_DEADLINE (~0ULL) /* wait_event() blocks until a signal arrives */
+
+/* a job is one line of the job file, or the job given on the command line */
+struct job{
+	char *name; /* -n, defaults to the child path, used in the log messages */
+	char *child;
+	char **argv; /* terminated with null pointer */
+	char **options; /* the words of the options of the job, for -e */
+	unsigned int noptions;
+	unsigned short clearenv; /* -E, the children start with an empty environment */
+	char **envp; /* environ with -E and -e applied, see exec.c, NULL without them */
+	char *childpidfile;
+	/* all durations are in nanoseconds */
+	unsigned long long interval; /* 0 with a calendar */
+	char *calendar; /* the cron expression given instead of the interval, NULL without one */
+	struct calendar cal;
+	unsigned long long kill_after;
+	unsigned long long kill_grace; /* -K, how long to wait between SIGTERM and SIGKILL */
+	unsigned short overlap; /* -o, one of OVERLAP_* */
+	unsigned int max_running; /* -o<N>, 1 for the other policies */
+	unsigned short priority; /* -q, higher priorities leave the admission queue first */
+	unsigned long long splay; /* -S, the window of the phase offset, SPLAY_NONE to use the global -S */
+	unsigned int capture; /* -c, how many bytes of the output to keep, 0 to not capture it */
+	char *output; /* -O, where to forward the output, a file or a UNIX stream socket */
+	char *cgroup; /* -g, the cgroup v2 directory the children are moved into */
+	int cgfd; /* the directory of -g, -1 without one */
+	int peakfd; /* its memory.peak, kept open since a reset only applies to the reads through the fd written to */
+	unsigned long long memory_max; /* -m, the memory.max of the cgroup, 0 to leave it alone */
+	unsigned int cpu_max; /* -u, the cpu.max of the cgroup in percent of one CPU, 0 to leave it alone */
+	unsigned long cpus[CPUS_MAX / (8 * sizeof(unsigned long))]; /* -a, the CPU affinity */
+	unsigned short has_cpus;
+	int nice; /* -N */
+	unsigned short has_nice;
+	unsigned short ioclass; /* -I, 1 realtime, 2 best-effort, 3 idle like IOPRIO_CLASS_*, 0 to leave it alone */
+	unsigned short iolevel; /* 0 to 7, 0 is the highest priority */
+	unsigned short hold_exe; /* -x, execute the child opened at startup */
+	int exefd; /* the child opened at startup, -1 without -x */
+	unsigned int pool; /* -Z, how many helpers are forked ahead of the runs */
+	int passfds[JOB_PASSFDS]; /* -F, the fds the children inherit */
+	unsigned short npassfds;
+	unsigned long long backoff; /* -B, how long the runs are skipped after the failures, 0 without -B */
+	unsigned long long backoff_max; /* -B<duration>,<max>, where the doubling stops */
+	unsigned int backoff_after; /* -B<duration>,<max>,<N>, how many failures in a row it takes */
+	unsigned int catchup; /* -U, how many of the runs missed since the last one are made up, CATCHUP_ALL for all of them */
+	unsigned short has_catchup;
+	char *lease; /* -l, shared by the hosts which run the job, only one of them runs a tick, NULL without one */
+	unsigned long long lease_hold; /* -l<lease>,<hold>, how long after the run is due the lease is held, 0 for half the time to the next run */
+	const struct lease_backend *leaseb; /* see lease.c */
+	int leasefd; /* the lease of the backend, -1 if it isn't open */
+	char *after; /* -A, the jobs this one runs after instead of on a schedule, cut at the first comma by chain_link(), NULL without -A */
+	struct job *preds[JOB_AFTER]; /* those jobs, resolved by chain_link() */
+	unsigned short npreds;
+	struct job **succ; /* the jobs which run after this one, in jobtable.chain */
+	unsigned int nsucc;
+	struct schedrec *sched; /* the record of the job in the schedule file of -H, NULL without one */
+	/* the scheduler state of the job, from here to the end it is moved as a whole by a reload */
+	unsigned long long start; /* the runs are due at start + tick*interval */
+	unsigned long long tick;
+	unsigned long long fire; /* with a calendar, the next run on the wall clock */
+	unsigned long long due; /* the deadline of the last run, for the spawn latency of the metrics */
+	struct timer run; /* the next run */
+	struct timer queued; /* starts the run which waited for the previous one to end, see OVERLAP_QUEUE */
+	struct timer admit; /* the place in the admission queue while the run waits for -C or -R, keyed on priority and arrival */
+	unsigned long long admit_since; /* when the run started waiting for admission */
+	struct proc *procs; /* the running children */
+	unsigned int running;
+	unsigned short pending; /* a run is waiting for the running child to end */
+	unsigned long long missed; /* the missed runs still to be made up, see -U */
+	unsigned int failures; /* the runs which failed since the last one which succeeded */
+	unsigned long long backoff_until; /* with -B, no run starts before, see backoff.c */
+	struct proc *spares; /* the helpers of -Z waiting for a run */
+	unsigned int nspares;
+	struct timer refill; /* forks the helpers taken by the runs again, see prefork.c */
+	struct timer claim; /* claims the lease of -l ahead of the next run, see lease.c */
+	unsigned long long claimed; /* the deadline of the run the lease was last claimed for */
+	unsigned short leased; /* how that went, one of the LEASE_* of lease.c */
+	struct{
+		unsigned long long killed, skipped, queued, concurrent;
+	} overlaps; /* how often the overlap policies triggered */
+	struct{
+		unsigned long long ok, failed, terminated, killed, unstarted; /* exited with 0, exited otherwise, ended after SIGTERM, SIGKILL, couldn't execute */
+	} outcomes; /* how the runs ended */
+	struct{
+		unsigned long long opened, skipped;
+	} backoffs; /* how often -B started skipping the runs, and how many it skipped */
+	struct{
+		unsigned long long won, lost, failed;
+	} leases; /* the claims of the lease of -l, by whether this host got it */
+	unsigned int waiting; /* with -A, the predecessors which have succeeded since the last run, by their place in preds */
+	unsigned short ready; /* all of them have, the job is on state.ready */
+	struct job *nextready;
+	struct{
+		unsigned long long triggered, coalesced;
+	} chained; /* the runs the predecessors started, and how often they were ready again before it */
+	unsigned short paused; /* no runs start from the schedule or -A, see control.c */
+	unsigned long long file_interval; /* the interval in the job file while the one set over -X replaces it, 0 otherwise */
+	struct{
+		unsigned long long utime, stime; /* nanoseconds */
+		unsigned long long inblock, oublock, nvcsw, nivcsw;
+		unsigned long long cg_cpu, cg_rbytes, cg_wbytes; /* with -g */
+	} usage; /* the resources of all runs, from wait4(2) */
+	unsigned short peak_reset; /* memory.peak was reset when the run started, so it is the peak of the runs since then */
+	struct runstat *runs; /* the last RUN_WINDOW runs, by nruns % RUN_WINDOW, allocated by stats_open() */
+	unsigned long long nruns;
+	/* the captured output of all children of the job, see output.c */
+	char *outbuf; /* the ring of -c */
+	unsigned long long outhead; /* how many bytes were written to it, the ring holds the last capture of them */
+	int outfd; /* the destination of -O, -1 if it isn't open */
+	unsigned short outsplice; /* it is a socket or a pipe, which splice(2) can write to */
+	unsigned long long output_lost; /* the bytes which could not be forwarded */
+	struct jobtable *retired; /* a reload dropped or changed the job, it stays until its children have ended */
+};
+
+/* the struct a timer or a watcher is embedded in */
+#define TIMER_OWNER(t, type, member) ((type*)((char*)(t) - offsetof(type, member)))
+#define WATCHER_OWNER(w, type, member) TIMER_OWNER(w, type, member)
+
+/* the jobs live in one array, their strings and argv arrays in two allocations shared by all of them */
+struct jobtable{
+	struct job *job;
+	unsigned int njobs;
+	char *strings; /* the contents of the job file, split in place */
+	char **argv; /* the argv arrays of all jobs, one after the other */
+	struct job **chain; /* the successor lists of all jobs, see chain.c */
+	struct jobtable *next; /* from config.jobs on, the tables replaced by a reload which still have children running */
+	unsigned int live; /* how many of its jobs still have children */
+};
+
+/* the global struct which holds the minicron config */
+struct minicron_config{
+	char *daemonpidfile;
+	char *statefile; /* -T, the running children, rewritten once per round of the event loop */
+	char *schedfile; /* -H, the schedule file, see persist.c */
+	unsigned int catchup; /* -U, the default of the jobs, 1 unless given */
+	char *jobfile;
+	unsigned short daemon;
+	unsigned short syslog;
+	char *logfile; /* -L, the structured log, a file or a UNIX datagram socket */
+	unsigned short logjson; /* -j, write the structured log as JSON instead of key=value */
+	unsigned short verbose; /* -v, also log the LOG_DEBUG messages */
+	unsigned int max_children; /* -C, how many children of all jobs may run at a time, 0 for no limit */
+	unsigned int spawn_rate; /* -R, how many children may be started per second, 0 for no limit */
+	unsigned int spawn_burst; /* -R<rate>,<burst>, how many of them may start at once, defaults to the rate */
+	unsigned long long splay; /* -S, the default splay window of the jobs, SPLAY_NONE if not given */
+	char *metrics; /* -M, where to serve the metrics, a UNIX socket path or [host]:port */
+	char *control; /* -X, the UNIX socket of the control commands, see control.c */
+	int *passfds; /* the fds of -F of all jobs, sorted, everything else is close-on-exec */
+	unsigned int npassfds;
+	struct jobtable jobs;
+};
+
+/* the state struct holds a few global variables, which we can't or don't want to pass as arguments */
+struct minicron_state{
+	unsigned short stopping; /* SIGTERM was received, set by handle_signals(), we exit once the children have ended */
+	struct pollfd *pollfds; /* the fds of the watchers, in the same order */
+	struct watcher **watchers;
+	unsigned int nwatchers;
+	unsigned int watchers_size;
+	struct timerheap timers; /* the run and -k deadlines of all jobs, the main loop sleeps until the earliest one */
+	struct proc *procs; /* the child slots */
+	unsigned int nprocs;
+	struct proc *free; /* the unused child slots */
+	unsigned int running; /* the children of all jobs, limited by -C */
+	unsigned int untracked; /* the running children without an exit notification, reaped on SIGCHLD */
+	struct timerheap admission; /* the runs waiting for -C or -R, the key orders them by priority, then by arrival */
+	unsigned long long admission_seq;
+	struct timer admit; /* admits the waiting runs from the main loop once there is room */
+	unsigned long long spawn_tat; /* the token bucket of -R, as the theoretical arrival time of the next start */
+	struct{
+		unsigned long long waited; /* runs which had to wait, and how long */
+		unsigned long long wait_total;
+		unsigned long long wait_max; /* the high-water marks since the start */
+		unsigned int depth_max;
+	} admission_stats;
+	sigset_t sigmask; /* the signal mask we started with, the event loop unblocks our signals only inside ppoll(2) */
+	char *statebuf; /* where the state file of -T is formatted, big enough for all children */
+	size_t statesize;
+	unsigned short statedirty; /* a child has started or ended since the state file was written */
+	struct schedrec *sched; /* the records of the schedule file of -H, mapped shared, in the order of config.jobs */
+	unsigned int nsched;
+	size_t schedsize; /* the size of the mapping, with the header */
+	struct watcher clockjump; /* on Linux, a timerfd readable once the wall clock has been set, see calendar.c */
+	struct timer clockcheck; /* elsewhere, compares the clocks once a minute */
+	unsigned long long clockoffset; /* the wall clock minus the monotonic clock */
+	struct job *ready; /* the jobs of -A whose predecessors have all succeeded, started together by the chain timer */
+	struct job **readytail;
+	struct timer chain;
+};
+
+/* the counters of log.c */
+struct logstats{
+	unsigned long long logged;
+	unsigned long long written;
+	unsigned long long dropped; /* the ring was full */
+	unsigned long long lost; /* skipped by a sink which wasn't connected, so they aren't reported in the log */
+};
+
+/* see metrics.c */
+#define HIST_MIN_SHIFT 10
+#define HIST_MAX_SHIFT 42
+#define HIST_SUB_BITS 2
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (2 + (HIST_MAX_SHIFT - HIST_MIN_SHIFT) * HIST_SUB)
+
+/* the nanoseconds of some event, in log-linear buckets */
+struct histogram{
+	unsigned long long bucket[HIST_BUCKETS];
+	unsigned long long count;
+	unsigned long long sum;
+};
+
+struct metrics{
+	struct histogram lateness; /* of the run timers */
+	struct histogram spawn; /* from the deadline of a run until execve(2) */
+	struct histogram duration; /* of the runs */
+	unsigned long long spawn_failures;
+};
+
+extern struct minicron_config config;
+extern struct minicron_state state;
+extern struct logstats logstats;
+extern struct metrics metrics;
+extern char **environ;
+
+/* minicron.c */
+void usage(char *);
+int parse_args(int, char**);
+void close_fds(int, int);
+void daemonize();
+int write_atomic(char*, const char*, size_t, mode_t);
+void createpid(char*, pid_t);
+void deletepid(char*);
+
+/* jobs.c */
+void job_defaults(struct job*);
+int parse_duration(char*, unsigned long long*);
+int parse_size(char*, unsigned long long*);
+int parse_catchup(char*, unsigned int*);
+size_t fmt_duration(char*, unsigned long long);
+int parse_job_option(struct job*, char*);
+int parse_job(struct job*, char**);
+int load_jobs(char*, struct jobtable*);
+void free_jobs(struct jobtable*);
+
+/* log.c */
+void log_open();
+void log_msg(int, struct job*, pid_t, const char*, ...) __attribute__((format(printf, 4, 5)));
+void log_flush();
+void log_close();
+
+/* metrics.c */
+unsigned int hist_bucket(unsigned long long);
+unsigned long long hist_bound(unsigned int);
+void hist_record(struct histogram*, unsigned long long);
+int metrics_open();
+void metrics_close();
+
+/* output.c */
+int output_open(struct job*);
+int output_start(struct proc*);
+void output_child(struct proc*);
+void output_started(struct proc*);
+void output_ready(struct watcher*, short);
+void output_read(struct proc*);
+void output_close(struct proc*);
+void output_finish(struct proc*, int);
+void output_report(struct proc*);
+
+/* exec.c */
+#define EXEC_SETUP 1 /* the steps of the child exec_started() reports */
+#define EXEC_EXEC 2
+int exec_open(struct job*);
+void exec_start(struct proc*);
+void exec_child(struct proc*, int);
+void exec_started(struct proc*);
+void exec_watch(struct proc*);
+void exec_finish(struct proc*);
+
+/* reload.c */
+void reload();
+void reload_ended(struct job*);
+
+/* control.c */
+int control_reserve(unsigned int);
+void control_index();
+int control_open();
+void control_close();
+
+/* backoff.c */
+void backoff_ended(struct job*, int);
+
+/* chain.c */
+char *chain_link(struct jobtable*);
+void chain_ended(struct job*, int);
+void chain_flush();
+void chain_timer(struct timer*, unsigned long long);
+void chain_stop();
+
+/* lease.c */
+int lease_open(struct job*);
+void lease_close(struct job*);
+void lease_schedule(struct job*);
+int lease_held(struct job*, unsigned long long);
+int lease_kept(struct job*);
+
+/* calendar.c */
+int parse_calendar(char*, struct calendar*);
+unsigned long long calendar_next(const struct calendar*, unsigned long long);
+unsigned long long calendar_missed(const struct calendar*, unsigned long long, unsigned long long, unsigned long long*);
+int calendar_open();
+
+/* persist.c */
+int persist_open();
+int persist_resume(struct job*, unsigned long long, unsigned long long, unsigned long long*);
+void persist_due(struct job*);
+void persist_started(struct job*);
+void persist_ended(struct job*, int);
+
+/* prefork.c */
+void prefork_fill(struct job*);
+struct proc *prefork_take(struct job*);
+void prefork_wait(struct proc*);
+void prefork_ended(struct proc*);
+void prefork_stop();
+
+/* isolate.c */
+int isolate_open(struct job*);
+int isolate_child(struct job*);
+
+/* stats.c */
+int stats_open(struct job*);
+void stats_start(struct proc*);
+void stats_end(struct proc*, int, struct rusage*);
+unsigned int stats_percentiles(struct job*, size_t, const unsigned int*, unsigned long long*, unsigned int);
+
+/* track.c */
+int track_open();
+void track_start(struct proc*);
+void track_end(struct proc*);
+int track_resize();
+struct proc *track_find(pid_t);
+void track_signal(struct proc*, int);
+
+/* sched.c */
+void kill_pid(struct proc*);
+void catch_signal(int);
+void setup_signals();
+unsigned long long monotonic_ns();
+unsigned long long wallclock_ns();
+int watch_add(struct watcher*);
+void watch_remove(struct watcher*);
+void wait_event(unsigned long long);
+void handle_signals();
+void reap_children();
+void child_ended(struct proc*, int, struct rusage*);
+void mainloop_stop();
+void mainloop_exit();
+void mainloop();
+unsigned long long first_run(struct job*, unsigned long long, unsigned long long, char*);
+int procs_reserve(unsigned int);
+int job_open(struct job*);
+void job_schedule(struct job*, unsigned long long);
+void catch_up(struct job*);
+int statefile_reserve();
+void statefile_flush();
+void run_job(struct job*, unsigned long long);
+void run_due(struct job*, unsigned long long);
+int run_allowed(struct job*, unsigned long long, int);
+void run_timer(struct timer*, unsigned long long);
+void kill_timer(struct timer*, unsigned long long);
+void queued_timer(struct timer*, unsigned long long);
+void kill_job(struct job*);
+void request_start(struct job*);
+int may_start(unsigned long long);
+void admit_timer(struct timer*, unsigned long long);
+void start_child(struct job*);
+int child(struct proc*);
+
+#ifdef BENCH
+/* minicron-bench runs the daemon on the simulated clock and children of bench.c, see there */
+#include <poll.h>
+#include <time.h>
+#define main(argc, argv) minicron_main(argc, argv)
+#define clock_gettime(id, ts) bench_clock_gettime(id, ts)
+#define ppoll(fds, n, timeout, mask) bench_ppoll(fds, n, timeout, mask)
+#define vfork() bench_vfork()
+#define kill(pid, sig) bench_kill(pid, sig)
+#define wait4(pid, status, options, ru) bench_wait4(pid, status, options, ru)
+int minicron_main(int, char**);
+int bench_clock_gettime(clockid_t, struct timespec*);
+int bench_ppoll(struct pollfd*, nfds_t, const struct timespec*, const sigset_t*);
+pid_t bench_vfork();
+int bench_kill(pid_t, int);
+pid_t bench_wait4(pid_t, int*, int, struct rusage*);
+#endif
+
+#endif
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE /* splice(2) and pipe2(2) on Linux */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <syslog.h> /* the LOG_* levels */
+#include <unistd.h>
+
+#include "minicron.h"
+
+/*
+ * the stdout and stderr of a child go into one pipe, which the main loop reads from without blocking
+ * with -c the last bytes of the output are kept in a ring of the job, allocated once, so a child flooding its
+ * output only overwrites its own older output - and when a run fails, its last lines are logged
+ * with -O the output is also forwarded to a file or a UNIX stream socket, using splice(2) if nothing is kept
+ * and the destination is a socket - splice(2) can't write to a file opened with O_APPEND, which -O needs so it
+ * doesn't overwrite what others have written to the file
+ * the children of a job which run at the same time (-o<N>) share the ring and the destination, their output is
+ * interleaved in the chunks it was read in, without marking which child wrote what, and the lines logged when
+ * one of them fails may be from the others
+ */
+#define OUTPUT_CHUNK 65536 /* the most read per wakeup, so a flooding child can't starve the other jobs */
+#define OUTPUT_REPORT_LINES 10 /* how many of the last lines are logged when a run fails */
+#define OUTPUT_LINE 200 /* and how much of each of them */
+
+static int output_connect(char*);
+static void output_forward(struct job*, char*, size_t);
+
+/* opens -O like the -L of log.c: appends to a file, or connects to the socket if the path is one */
+static int output_connect(char *path) {
+	struct sockaddr_un sun;
+	struct stat st;
+	int fd;
+
+	if (stat(path, &st) || !S_ISSOCK(st.st_mode))
+		return open(path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK | O_CLOEXEC, 0640);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) >= 0 && connect(fd, (struct sockaddr*)&sun, sizeof(sun))) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/* allocates the ring of -c and opens -O, called once per job by mainloop() */
+int output_open(struct job *job) {
+	struct stat st;
+
+	job->outfd = -1;
+	job->outsplice = 0;
+	if (job->capture && (job->outbuf = malloc(job->capture)) == NULL)
+		return 1;
+	job->outhead = 0;
+	if (job->output && (job->outfd = output_connect(job->output)) < 0)
+		log_msg(LOG_WARNING, job, 0, "Could not open %s, the output of %s won't be forwarded.", job->output, job->name);
+	else if (job->output && !fstat(job->outfd, &st))
+		job->outsplice = S_ISSOCK(st.st_mode) || S_ISFIFO(st.st_mode);
+	return 0;
+}
+
+/* a destination which can't take more right now loses the rest, the child is never blocked on it */
+static void output_forward(struct job *job, char *buf, size_t n) {
+	ssize_t r;
+
+	if (job->outfd < 0)
+		return;
+	r = write(job->outfd, buf, n);
+	if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) { /* the socket was closed */
+		log_msg(LOG_WARNING, job, 0, "Could not write to %s, no longer forwarding the output of %s.", job->output, job->name);
+		close(job->outfd);
+		job->outfd = -1;
+	}
+	if ((size_t)r != n)
+		job->output_lost += r < 0 ? n : n - r;
+}
+
+/* creates the pipe of the child before vfork(2), the write end is passed in proc->outw, returns 1 without -c or -O */
+int output_start(struct proc *proc) {
+	struct job *job = proc->job;
+	int fds[2];
+
+	proc->outstart = job->outhead;
+	if (!job->capture && job->outfd < 0)
+		return 1;
+	if (pipe2(fds, O_CLOEXEC)) {
+		log_msg(LOG_WARNING, job, 0, "Could not create the output pipe of %s, its output is lost this run.", job->name);
+		return 1;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	proc->out.fd = fds[0];
+	proc->out.events = POLLIN;
+	proc->outw = fds[1];
+	return 0;
+}
+
+/* in the child, dup2(2) clears the O_CLOEXEC of the copies */
+void output_child(struct proc *proc) {
+	if (proc->out.fd < 0)
+		return;
+	dup2(proc->outw, STDOUT_FILENO);
+	dup2(proc->outw, STDERR_FILENO);
+}
+
+/* in the parent after vfork(2), only the child holds the write end from now on */
+void output_started(struct proc *proc) {
+	if (proc->out.fd < 0)
+		return;
+	close(proc->outw);
+	if (watch_add(&proc->out))
+		output_close(proc);
+}
+
+void output_ready(struct watcher *w, short revents) {
+	struct proc *proc = WATCHER_OWNER(w, struct proc, out);
+	(void)revents;
+	output_read(proc);
+}
+
+/* reads what the child has written so far, at most OUTPUT_CHUNK bytes */
+void output_read(struct proc *proc) {
+	static char scratch[OUTPUT_CHUNK];
+	struct job *job = proc->job;
+	struct iovec iov[2];
+	size_t pos, total = 0, want;
+	ssize_t r = 1;
+
+	while (total < OUTPUT_CHUNK) {
+#ifdef __linux__
+		/* nothing is kept, so the output goes from the pipe to the destination without passing through us */
+		if (!job->capture && job->outfd >= 0 && job->outsplice) {
+			r = splice(proc->out.fd, NULL, job->outfd, NULL, OUTPUT_CHUNK - total, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+			if (r > 0) {
+				total += r;
+				continue;
+			}
+			if (r == 0)
+				break;
+			if (errno == EINVAL) /* not this destination after all, don't try again on every read */
+				job->outsplice = 0;
+			/* EAGAIN with POLLIN means the destination is full, so the output is read and dropped below */
+		}
+#endif
+		want = OUTPUT_CHUNK - total;
+		if (job->capture) {
+			/* straight into the ring, the part up to its end and the part wrapping around to its start */
+			pos = job->outhead % job->capture;
+			if (want > job->capture)
+				want = job->capture;
+			iov[0].iov_base = job->outbuf + pos;
+			iov[0].iov_len = want < job->capture - pos ? want : job->capture - pos;
+			iov[1].iov_base = job->outbuf;
+			iov[1].iov_len = want - iov[0].iov_len;
+			r = readv(proc->out.fd, iov, 2);
+		}
+		else
+			r = read(proc->out.fd, scratch, want);
+		if (r <= 0)
+			break;
+
+		total += r;
+		if (job->capture) {
+			if ((size_t)r > iov[0].iov_len) {
+				output_forward(job, iov[0].iov_base, iov[0].iov_len);
+				output_forward(job, job->outbuf, r - iov[0].iov_len);
+			}
+			else
+				output_forward(job, iov[0].iov_base, r);
+			job->outhead += r;
+		}
+		else
+			output_forward(job, scratch, r);
+	}
+
+	/* EOF, the child and everything it started have closed the pipe */
+	if (r == 0)
+		output_close(proc);
+}
+
+void output_close(struct proc *proc) {
+	if (proc->out.fd < 0)
+		return;
+	watch_remove(&proc->out);
+	close(proc->out.fd);
+	proc->out.fd = -1;
+}
+
+/*
+   called by child_ended(), the output the child wrote before exiting is still in the pipe
+   whatever it started in the background and is still holding the pipe is cut off here
+*/
+void output_finish(struct proc *proc, int failed) {
+	struct job *job = proc->job;
+
+	if (proc->out.fd >= 0) { /* otherwise it has already seen EOF */
+		output_read(proc);
+		output_close(proc);
+	}
+
+	if (job->output_lost) {
+		log_msg(LOG_WARNING, job, proc->pid, "Could not forward %llu bytes of the output of %s.", job->output_lost, job->name);
+		job->output_lost = 0;
+	}
+	if (failed)
+		output_report(proc);
+}
+
+/* logs the last lines of the ring, as far as they were written since the child started */
+void output_report(struct proc *proc) {
+	struct job *job = proc->job;
+	unsigned long long start, end, i;
+	unsigned int lines = 0;
+	char text[OUTPUT_LINE];
+	size_t n;
+
+	if (!job->capture || job->outhead == proc->outstart)
+		return;
+
+	/* find where the last OUTPUT_REPORT_LINES lines start, ignoring a trailing newline */
+	end = job->outhead;
+	start = end - proc->outstart > job->capture ? end - job->capture : proc->outstart;
+	if (job->outbuf[(end - 1) % job->capture] == '\n')
+		end--;
+	for (i = end; i > start; i--)
+		if (job->outbuf[(i - 1) % job->capture] == '\n' && ++lines == OUTPUT_REPORT_LINES)
+			break;
+
+	/* one message per line, the lines longer than a log message are cut */
+	while (i < end) {
+		for (n = 0; i < end && job->outbuf[i % job->capture] != '\n'; i++)
+			if (n < sizeof(text) - 1)
+				text[n++] = job->outbuf[i % job->capture];
+		text[n] = '\0';
+		i++;
+		log_msg(LOG_WARNING, job, proc->pid, "Output of %s: %s", job->name, text);
+	}
+}
@@ -0,0 +1,221 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h> /* the LOG_* levels */
+#include <unistd.h>
+
+#include "minicron.h"
+
+/*
+ * the schedule file of -H keeps a fixed size record for every job - when it last ran, how it ended and when it
+ * is due next - so a restart continues the schedule instead of starting it over, and catches up on the runs
+ * it missed meanwhile as -U says
+ * the file is mapped shared and the records are updated with plain stores, the kernel writes them back, so a
+ * run costs no system call and the records survive minicron crashing (not the host crashing, there is no msync(2))
+ * at startup and on a reload the records are matched with the jobs by name through a hash table and the file is
+ * rewritten in the order of the job table, so it only ever holds the current jobs and is read in O(jobs)
+ */
+#define SCHED_MAGIC "mcsched1"
+
+struct schedhdr{
+	char magic[8];
+	unsigned int recsize; /* sizeof(struct schedrec), a file of another build isn't read */
+	unsigned int nrecs;
+};
+
+static unsigned long long name_hash(const char*);
+static struct schedrec *read_records(unsigned int*, size_t*);
+
+/* FNV-1a, like the phase offset of -S */
+static unsigned long long name_hash(const char *s) {
+	unsigned long long hash = 14695981039346656037ULL;
+
+	for (; *s; s++)
+		hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+	return hash;
+}
+
+/* maps the records of the file as it was left, NULL if there is none or it isn't ours */
+static struct schedrec *read_records(unsigned int *n, size_t *size) {
+	struct schedhdr *hdr;
+	struct stat st;
+	void *p;
+	int fd;
+
+	*n = 0;
+	if ((fd = open(config.schedfile, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct schedhdr)
+		|| (p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	hdr = p;
+	if (memcmp(hdr->magic, SCHED_MAGIC, sizeof(hdr->magic)) || hdr->recsize != sizeof(struct schedrec)
+		|| (size_t)st.st_size != sizeof(struct schedhdr) + (size_t)hdr->nrecs * sizeof(struct schedrec)) {
+		log_msg(LOG_WARNING, NULL, 0, "%s isn't a schedule file of this minicron, starting the schedule over.", config.schedfile);
+		munmap(p, st.st_size);
+		return NULL;
+	}
+	*n = hdr->nrecs;
+	*size = st.st_size;
+	return (struct schedrec*)(hdr + 1);
+}
+
+/*
+   called by mainloop() and after a reload has replaced config.jobs, gives every job its record, the one it had
+   before or a new one - returns 1 if the file can't be written, the jobs are left without records then
+*/
+int persist_open() {
+	struct schedrec *old, *recs, *r;
+	unsigned int i, k, nold, nb, *index = NULL;
+	unsigned long long hash;
+	size_t oldsize = 0, size;
+	struct jobtable *t;
+	struct job *job;
+	char *buf = NULL;
+	void *p;
+	int fd;
+
+	if (config.schedfile == NULL)
+		return 0;
+	/* the records of the retired jobs go away with the old mapping */
+	for (t = config.jobs.next; t; t = t->next)
+		for (i = 0; i < t->njobs; i++)
+			t->job[i].sched = NULL;
+	if (state.sched) {
+		old = state.sched;
+		nold = state.nsched;
+	}
+	else if ((old = read_records(&nold, &oldsize)) == NULL)
+		nold = 0;
+
+	/* open addressing keyed on the hash, 0 is empty and ~0 taken, so the k-th job of a name gets the k-th record */
+	for (nb = 16; nb < 2 * nold; nb *= 2);
+	size = sizeof(struct schedhdr) + (size_t)config.jobs.njobs * sizeof(struct schedrec);
+	if ((index = calloc(nb, sizeof(unsigned int))) == NULL || (buf = malloc(size)) == NULL)
+		goto fail;
+	for (i = 0; i < nold; i++) {
+		for (k = old[i].hash & (nb - 1); index[k]; k = (k + 1) & (nb - 1));
+		index[k] = i + 1;
+	}
+
+	memset(buf, 0, size);
+	memcpy(((struct schedhdr*)buf)->magic, SCHED_MAGIC, sizeof(((struct schedhdr*)buf)->magic));
+	((struct schedhdr*)buf)->recsize = sizeof(struct schedrec);
+	((struct schedhdr*)buf)->nrecs = config.jobs.njobs;
+	recs = (struct schedrec*)(buf + sizeof(struct schedhdr));
+	for (i = 0; i < config.jobs.njobs; i++) {
+		job = &config.jobs.job[i];
+		hash = name_hash(job->name);
+		for (k = hash & (nb - 1); index[k]; k = (k + 1) & (nb - 1)) {
+			if (index[k] == ~0U)
+				continue;
+			r = &old[index[k] - 1];
+			if (r->hash == hash && !strncmp(r->name, job->name, sizeof(r->name))) {
+				recs[i] = *r;
+				index[k] = ~0U;
+				break;
+			}
+		}
+		recs[i].hash = hash;
+		memcpy(recs[i].name, job->name, strnlen(job->name, sizeof(recs[i].name))); /* a new record is zeroed */
+	}
+
+	/* written in full rather than extended with ftruncate(2), so a full disk fails here and not as SIGBUS on a store */
+	if (write_atomic(config.schedfile, buf, size, 0644) || (fd = open(config.schedfile, O_RDWR | O_CLOEXEC)) < 0)
+		goto fail;
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		goto fail;
+
+	if (state.sched)
+		munmap((char*)state.sched - sizeof(struct schedhdr), state.schedsize);
+	else if (old)
+		munmap((char*)old - sizeof(struct schedhdr), oldsize);
+	state.sched = (struct schedrec*)((char*)p + sizeof(struct schedhdr));
+	state.nsched = config.jobs.njobs;
+	state.schedsize = size;
+	for (i = 0; i < config.jobs.njobs; i++)
+		config.jobs.job[i].sched = &state.sched[i];
+	free(index);
+	free(buf);
+	return 0;
+
+fail:
+	if (old && !state.sched)
+		munmap((char*)old - sizeof(struct schedhdr), oldsize);
+	for (i = 0; i < config.jobs.njobs; i++)
+		config.jobs.job[i].sched = NULL;
+	free(index);
+	free(buf);
+	return 1;
+}
+
+/*
+   called by mainloop() before the first run of the job, returns 1 and the monotonic time of the first run if the
+   record of the job continues its schedule - the runs missed while minicron wasn't running are left in job->missed
+*/
+int persist_resume(struct job *job, unsigned long long now, unsigned long long wallclock, unsigned long long *start) {
+	unsigned long long due, next, missed, last, limit;
+
+	if (job->sched == NULL || (due = job->sched->next_due) == 0 || (job->interval == 0 && job->calendar == NULL))
+		return 0;
+	if (job->calendar) {
+		next = calendar_next(&job->cal, wallclock);
+		if (due > wallclock) {
+			if (due > next) /* the clock went back, or the calendar has changed */
+				return 0;
+			job->fire = due;
+			*start = now + (due - wallclock);
+			return 1;
+		}
+		missed = 1 + calendar_missed(&job->cal, due, wallclock, &last);
+		job->fire = next;
+		*start = next ? now + (next - wallclock) : NO_DEADLINE;
+	}
+	else if (due > wallclock) {
+		if (due - wallclock > job->interval) /* the clock went back, or the interval is shorter now */
+			return 0;
+		*start = now + (due - wallclock);
+		return 1;
+	}
+	else {
+		/* the first run goes on at the next boundary, the missed ones start right away, one after the other */
+		missed = (wallclock - due) / job->interval + 1;
+		last = due + (missed - 1) * job->interval;
+		*start = now + (last + job->interval - wallclock);
+	}
+	limit = job->lease ? 0 : job->has_catchup ? job->catchup : config.catchup; /* the other hosts of -l have run them */
+	job->missed = missed < limit ? missed : limit;
+	log_msg(LOG_NOTICE, job, 0, "Missed %llu runs of %s while stopped, catching up on %llu of them.", missed, job->name, job->missed);
+	return 1;
+}
+
+/* called by job_schedule(), run_job() and calendar.c once the next run is on the heap */
+void persist_due(struct job *job) {
+	if (job->sched == NULL || !job->run.slot)
+		return;
+	if (job->calendar)
+		job->sched->next_due = job->fire;
+	else
+		job->sched->next_due = wallclock_ns() + job->run.when - monotonic_ns();
+}
+
+/* called by start_child() */
+void persist_started(struct job *job) {
+	if (job->sched)
+		job->sched->last_run = wallclock_ns();
+}
+
+/* called by child_ended() with the wait(2) status, -1 if the child couldn't be executed */
+void persist_ended(struct job *job, int status) {
+	if (job->sched) {
+		job->sched->last_end = wallclock_ns();
+		job->sched->last_status = status;
+	}
+}
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE /* pipe2(2) */
+#include <fcntl.h>
+#include <syslog.h> /* the LOG_* levels */
+#include <unistd.h>
+
+#include "minicron.h"
+
+/*
+ * with -Z, a job keeps a pool of helpers which have been forked and set up like a child (the output pipe,
+ * the fds, the cgroup, the limits) and are blocked reading a pipe - a run takes one, writes a byte into
+ * its pipe and only has to wait for the execve(2), instead of the vfork(2) and the setup
+ * the pool is refilled by a timer due right away, so the other runs due now are started first
+ * a helper whose pipe is closed without the byte exits, so they don't outlive minicron
+ */
+static void prefork_refill(struct timer*, unsigned long long);
+
+/* forks helpers until the pool of the job is full, called by mainloop() and the refill timer */
+void prefork_fill(struct job *job) {
+	struct proc *proc, *other;
+	unsigned int i;
+	int fds[2];
+	pid_t pid;
+
+	job->refill.fire = prefork_refill;
+	while (job->nspares < job->pool && (proc = state.free)) {
+		if (pipe2(fds, O_CLOEXEC)) {
+			log_msg(LOG_WARNING, job, 0, "Could not create the pipe of a helper of %s.", job->name);
+			return;
+		}
+		proc->job = job;
+		proc->spare = 1;
+		output_start(proc);
+		exec_start(proc);
+
+		pid = fork();
+		if (pid < 0) {
+			log_msg(LOG_WARNING, job, 0, "Could not fork a helper of %s.", job->name);
+			proc->spare = 0;
+			close(fds[0]);
+			close(fds[1]);
+			if (proc->out.fd >= 0) {
+				close(proc->outw);
+				output_close(proc);
+			}
+			if (proc->exec.fd >= 0) {
+				close(proc->exec.fd);
+				close(proc->execw);
+			}
+			return;
+		}
+		else if (pid == 0) {
+			/* the pipes of the other helpers are only closed once we exec, they must see EOF without us */
+			for (i = 0; i < config.jobs.njobs; i++)
+				for (other = config.jobs.job[i].spares; other; other = other->next)
+					close(other->go);
+			close(fds[1]);
+			proc->go = fds[0];
+			child(proc);
+		}
+
+		close(fds[0]);
+		proc->go = fds[1];
+		if (proc->execw >= 0) {
+			close(proc->execw); /* the helper has its own copy, exec_started() must see EOF once it has exec'd */
+			proc->execw = -1;
+		}
+		output_started(proc);
+
+		state.free = proc->next;
+		proc->pid = pid;
+		track_start(proc);
+		proc->next = job->spares;
+		job->spares = proc;
+		job->nspares++;
+	}
+}
+
+static void prefork_refill(struct timer *t, unsigned long long now) {
+	(void)now;
+	prefork_fill(TIMER_OWNER(t, struct job, refill));
+}
+
+/* a waiting helper released for the run, or NULL if the pool is empty */
+struct proc *prefork_take(struct job *job) {
+	struct proc *proc;
+
+	if ((proc = job->spares) == NULL)
+		return NULL;
+	stats_start(proc);
+	/* a helper which has died meanwhile stays in the pool until prefork_ended() reaps it, the run forks as usual */
+	if (write(proc->go, "", 1) != 1)
+		return NULL;
+	job->spares = proc->next;
+	job->nspares--;
+	proc->spare = 0;
+	proc->outstart = job->outhead;
+	close(proc->go);
+	proc->go = -1;
+
+	heap_insert(&state.timers, &job->refill, monotonic_ns());
+	return proc;
+}
+
+/* in the helper, before it executes the child, returns only once it has been released */
+void prefork_wait(struct proc *proc) {
+	char c;
+
+	if (read(proc->go, &c, 1) != 1)
+		_exit(0);
+	close(proc->go);
+}
+
+/* called by child_ended() for a helper which exited before it was released */
+void prefork_ended(struct proc *proc) {
+	struct job *job = proc->job;
+	struct proc **p;
+
+	for (p = &job->spares; *p != proc; p = &(*p)->next);
+	*p = proc->next;
+	job->nspares--;
+	proc->spare = 0;
+	if (proc->go >= 0)
+		close(proc->go);
+	proc->go = -1;
+	if (proc->exec.fd >= 0) {
+		close(proc->exec.fd);
+		proc->exec.fd = -1;
+	}
+	output_close(proc);
+	track_end(proc);
+	proc->pid = 0;
+	proc->next = state.free;
+	state.free = proc;
+	if (job->retired && job->running == 0 && job->nspares == 0)
+		reload_ended(job);
+}
+
+/* called by mainloop_stop(), the helpers see EOF and exit */
+void prefork_stop() {
+	struct proc *proc;
+	unsigned int i;
+
+	for (i = 0; i < config.jobs.njobs; i++) {
+		heap_remove(&state.timers, &config.jobs.job[i].refill);
+		for (proc = config.jobs.job[i].spares; proc; proc = proc->next)
+			if (proc->go >= 0) {
+				close(proc->go);
+				proc->go = -1;
+			}
+	}
+}
@@ -0,0 +1,23 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * the static probes of minicron.d, with -DUSE_SDT they come from the header dtrace -h generates (on Linux the
+ * dtrace of systemtap, whose probes are listed by perf list sdt_minicron:* or bpftrace -l usdt:minicron:*)
+ * a disabled probe is a nop in the code, and without USE_SDT there is nothing at all - with it the arguments are
+ * evaluated even while the probe is disabled, so the ones which cost something are only computed if it is enabled
+ */
+#ifdef USE_SDT
+#include "minicron_dtrace.h"
+#else
+#define MINICRON_TICK_FIRE(job, tick, late) do { } while (0)
+#define MINICRON_SPAWN_START(job, late) do { } while (0)
+#define MINICRON_SPAWN_START_ENABLED() 0
+#define MINICRON_EXEC_SUCCESS(job, latency) do { } while (0)
+#define MINICRON_EXEC_FAILURE(job, step, err) do { } while (0)
+#define MINICRON_SIGTERM(job, pid) do { } while (0)
+#define MINICRON_SIGKILL(job, pid) do { } while (0)
+#define MINICRON_CHILD_EXIT(job, pid, status, duration) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,327 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h> /* the LOG_* levels */
+#include <time.h>
+#include <unistd.h>
+
+#include "minicron.h"
+
+/*
+ * SIGHUP loads the job file again and matches the new jobs with the running ones by name, so only what has
+ * changed is touched: an unchanged job keeps its timers, its children and its counters, which are moved into
+ * its struct in the new table - a changed job is replaced by one with a new schedule, and a removed job is
+ * retired: like the replaced ones it starts nothing anymore, but its children run to their end, with their
+ * -k and -K deadlines, and only then is what they use closed and the old table freed
+ * everything the new jobs need is opened and allocated before anything is changed, so a job file which
+ * doesn't load or a child which can't be executed leaves the running jobs as they are
+ */
+#define KEPT 0x80000000U /* in match[], the job hasn't changed */
+
+static int cmp_name(const void*, const void*);
+static int same_string(const char*, const char*);
+static int same_env(struct job*, struct job*);
+static unsigned long long file_interval(struct job*);
+static int same_job(struct job*, struct job*);
+static int passfds_inherited(struct job*);
+static void job_move(struct job*, struct job*);
+static unsigned int job_retire(struct job*, struct jobtable*);
+static void job_release(struct job*);
+
+/* by name and then by position, so the k-th job of a name is matched with the k-th one of the old table */
+static int cmp_name(const void *a, const void *b) {
+	const struct job *x = *(struct job * const*)a, *y = *(struct job * const*)b;
+	int c = strcmp(x->name, y->name);
+
+	return c ? c : (x > y) - (x < y);
+}
+
+static int same_string(const char *a, const char *b) {
+	return a == b || (a && b && !strcmp(a, b));
+}
+
+/* the -e of both in the same order */
+static int same_env(struct job *a, struct job *b) {
+	unsigned int i = 0, k = 0;
+
+	while (1) {
+		for (; i < a->noptions && a->options[i][1] != 'e'; i++);
+		for (; k < b->noptions && b->options[k][1] != 'e'; k++);
+		if (i == a->noptions || k == b->noptions)
+			return i == a->noptions && k == b->noptions;
+		if (strcmp(a->options[i++], b->options[k++]))
+			return 0;
+	}
+}
+
+/* the interval set over -X doesn't make the job a changed one */
+static unsigned long long file_interval(struct job *job) {
+	return job->file_interval ? job->file_interval : job->interval;
+}
+
+/* everything parse_job() sets */
+static int same_job(struct job *a, struct job *b) {
+	unsigned int i;
+
+	if (!same_string(a->childpidfile, b->childpidfile) || !same_string(a->output, b->output) || !same_string(a->cgroup, b->cgroup)
+		|| file_interval(a) != file_interval(b) || !same_string(a->calendar, b->calendar) || a->kill_after != b->kill_after || a->kill_grace != b->kill_grace
+		|| a->overlap != b->overlap || a->max_running != b->max_running || a->priority != b->priority || a->splay != b->splay
+		|| a->capture != b->capture || a->memory_max != b->memory_max || a->cpu_max != b->cpu_max
+		|| a->has_cpus != b->has_cpus || memcmp(a->cpus, b->cpus, sizeof(a->cpus)) || a->has_nice != b->has_nice || a->nice != b->nice
+		|| a->ioclass != b->ioclass || a->iolevel != b->iolevel || a->hold_exe != b->hold_exe || a->pool != b->pool
+		|| a->has_catchup != b->has_catchup || a->catchup != b->catchup
+		|| a->backoff != b->backoff || a->backoff_max != b->backoff_max || a->backoff_after != b->backoff_after
+		|| !same_string(a->lease, b->lease) || a->lease_hold != b->lease_hold || a->npreds != b->npreds
+		|| a->clearenv != b->clearenv || !same_env(a, b)
+		|| a->npassfds != b->npassfds || memcmp(a->passfds, b->passfds, a->npassfds * sizeof(int)))
+		return 0;
+	for (i = 0; i < a->npreds; i++)
+		if (strcmp(a->preds[i]->name, b->preds[i]->name))
+			return 0;
+	for (i = 0; a->argv[i] && b->argv[i]; i++)
+		if (strcmp(a->argv[i], b->argv[i]))
+			return 0;
+	return a->argv[i] == b->argv[i];
+}
+
+/* the fds which weren't given with -F at startup are close-on-exec by now */
+static int passfds_inherited(struct job *job) {
+	unsigned int i, k;
+
+	for (i = 0; i < job->npassfds; i++) {
+		for (k = 0; k < config.npassfds && config.passfds[k] != job->passfds[i]; k++);
+		if (k == config.npassfds) {
+			log_msg(LOG_ERR, job, 0, "The fd %d of -F of %s wasn't passed at startup.", job->passfds[i], job->name);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* the job hasn't changed, its scheduler state and what it has opened go over to its struct in the new table */
+static void job_move(struct job *old, struct job *job) {
+	struct proc *proc;
+
+	memcpy(&job->start, &old->start, sizeof(struct job) - offsetof(struct job, start));
+	if (job->file_interval)
+		job->interval = old->interval;
+	job->cgfd = old->cgfd;
+	job->peakfd = old->peakfd;
+	job->exefd = old->exefd;
+	job->leaseb = old->leaseb;
+	job->leasefd = old->leasefd;
+	job->envp = old->envp;
+	old->procs = old->spares = NULL;
+	old->running = old->nspares = 0;
+
+	/* the heaps and the children point to the old struct */
+	heap_moved(&state.timers, &job->run);
+	heap_moved(&state.timers, &job->queued);
+	heap_moved(&state.timers, &job->refill);
+	heap_moved(&state.timers, &job->claim);
+	heap_moved(&state.admission, &job->admit);
+	for (proc = job->procs; proc; proc = proc->next)
+		proc->job = job;
+	for (proc = job->spares; proc; proc = proc->next)
+		proc->job = job;
+}
+
+/* the job starts nothing anymore, returns 1 if it has to stay until its children have ended */
+static unsigned int job_retire(struct job *job, struct jobtable *t) {
+	struct proc *proc;
+
+	heap_remove(&state.timers, &job->run);
+	heap_remove(&state.timers, &job->queued);
+	heap_remove(&state.timers, &job->refill);
+	heap_remove(&state.timers, &job->claim);
+	heap_remove(&state.admission, &job->admit);
+	job->pending = 0;
+	job->missed = 0;
+	for (proc = job->spares; proc; proc = proc->next) /* the helpers see EOF and exit */
+		if (proc->go >= 0) {
+			close(proc->go);
+			proc->go = -1;
+		}
+
+	if (job->running == 0 && job->nspares == 0) {
+		job_release(job);
+		return 0;
+	}
+	job->retired = t;
+	return 1;
+}
+
+/* closes what job_open() has opened, the fds are -1 if it wasn't */
+static void job_release(struct job *job) {
+	if (job->outfd >= 0)
+		close(job->outfd);
+	if (job->cgfd >= 0)
+		close(job->cgfd);
+	if (job->peakfd >= 0)
+		close(job->peakfd);
+	if (job->exefd >= 0)
+		close(job->exefd);
+	job->outfd = job->cgfd = job->peakfd = job->exefd = -1;
+	lease_close(job);
+	free(job->outbuf);
+	free(job->runs);
+	free(job->envp);
+	job->outbuf = NULL;
+	job->runs = NULL;
+	job->envp = NULL;
+}
+
+/* called by child_ended() and prefork_ended() once the last child of a retired job has ended */
+void reload_ended(struct job *job) {
+	struct jobtable *t = job->retired, **p;
+
+	job_release(job);
+	job->retired = NULL;
+	if (--t->live)
+		return;
+	for (p = &config.jobs.next; *p != t; p = &(*p)->next);
+	*p = t->next;
+	free_jobs(t);
+	free(t);
+}
+
+void reload() {
+	unsigned long long begin, now, wallclock;
+	unsigned int i, j, n, kept = 0, changed = 0, added = 0, removed = 0;
+	struct job **oldjobs = NULL, **newjobs = NULL;
+	struct jobtable new, *old = NULL, *t;
+	unsigned int *match = NULL;
+	char hostname[256];
+	struct job *job;
+	int c;
+
+	if (config.jobfile == NULL) {
+		log_msg(LOG_WARNING, NULL, 0, "Received SIGHUP, but there is no job file to reload.");
+		return;
+	}
+	begin = monotonic_ns();
+	chain_flush(); /* the ready jobs are started before they move */
+	tzset(); /* the calendars follow a changed time zone from here on */
+	if (load_jobs(config.jobfile, &new)) {
+		log_msg(LOG_ERR, NULL, 0, "Could not load %s, keeping the jobs as they are.", config.jobfile);
+		return;
+	}
+	if ((old = malloc(sizeof(*old))) == NULL || (oldjobs = malloc(config.jobs.njobs * sizeof(struct job*))) == NULL
+		|| (newjobs = malloc(new.njobs * sizeof(struct job*))) == NULL || (match = calloc(new.njobs, sizeof(unsigned int))) == NULL) {
+		log_msg(LOG_ERR, NULL, 0, "Could not reload %s, out of memory.", config.jobfile);
+		goto fail;
+	}
+
+	/* both tables sorted by name, then one pass over both - match[j] is 1 + the index of the old job */
+	for (i = 0; i < config.jobs.njobs; i++)
+		oldjobs[i] = &config.jobs.job[i];
+	for (j = 0; j < new.njobs; j++)
+		newjobs[j] = &new.job[j];
+	qsort(oldjobs, config.jobs.njobs, sizeof(struct job*), cmp_name);
+	qsort(newjobs, new.njobs, sizeof(struct job*), cmp_name);
+	for (i = j = 0; i < config.jobs.njobs && j < new.njobs; ) {
+		if ((c = strcmp(oldjobs[i]->name, newjobs[j]->name)) == 0)
+			match[newjobs[j++] - new.job] = 1 + oldjobs[i++] - config.jobs.job;
+		else if (c < 0)
+			i++;
+		else
+			j++;
+	}
+
+	/* open the changed and the added jobs, and count the slots for all children that may run afterwards */
+	for (j = n = 0; j < new.njobs; j++) {
+		job = &new.job[j];
+		n += job->max_running + job->pool;
+		if (match[j] && same_job(&config.jobs.job[match[j] - 1], job)) { /* once the jobs move, -A can't be compared anymore */
+			match[j] |= KEPT;
+			continue;
+		}
+		if (!passfds_inherited(job) || job_open(job))
+			goto fail;
+	}
+	for (i = 0; i < config.jobs.njobs; i++)
+		n += config.jobs.job[i].running + config.jobs.job[i].nspares; /* an upper bound, the kept jobs are counted twice */
+	for (t = config.jobs.next; t; t = t->next)
+		for (i = 0; i < t->njobs; i++)
+			n += t->job[i].running + t->job[i].nspares;
+	if (procs_reserve(n) || heap_reserve(&state.timers, 4 * new.njobs + n + 3) || heap_reserve(&state.admission, new.njobs) || control_reserve(new.njobs)) {
+		log_msg(LOG_ERR, NULL, 0, "Could not reload %s, out of memory.", config.jobfile);
+		goto fail;
+	}
+	track_resize();
+
+	/* nothing can fail from here on */
+	for (j = 0; j < new.njobs; j++) {
+		if (!match[j])
+			added++;
+		else if (match[j] & KEPT) {
+			job = &config.jobs.job[(match[j] & ~KEPT) - 1];
+			job_move(job, &new.job[j]);
+			job->name = NULL; /* the mark for the loop below */
+			kept++;
+		}
+		else {
+			job = &config.jobs.job[match[j] - 1];
+			/* the counters go on, so the metrics of the job don't start over */
+			new.job[j].overlaps = job->overlaps;
+			new.job[j].outcomes = job->outcomes;
+			new.job[j].backoffs = job->backoffs;
+			new.job[j].leases = job->leases;
+			new.job[j].chained = job->chained;
+			new.job[j].usage = job->usage;
+			memcpy(new.job[j].runs, job->runs, RUN_WINDOW * sizeof(struct runstat));
+			new.job[j].nruns = job->nruns;
+			changed++;
+		}
+	}
+	*old = config.jobs;
+	old->live = 0;
+	for (i = 0; i < old->njobs; i++)
+		if (old->job[i].name != NULL)
+			old->live += job_retire(&old->job[i], old);
+	removed = old->njobs - kept - changed;
+
+	config.jobs = new;
+	control_index();
+	if (old->live)
+		config.jobs.next = old;
+	else {
+		config.jobs.next = old->next;
+		free_jobs(old);
+		free(old);
+	}
+
+	if (gethostname(hostname, sizeof(hostname)))
+		hostname[0] = '\0';
+	hostname[sizeof(hostname) - 1] = '\0';
+	if (calendar_open())
+		log_msg(LOG_WARNING, NULL, 0, "Could not watch the wall clock, the calendars don't follow when it is set.");
+	if (persist_open())
+		log_msg(LOG_WARNING, NULL, 0, "Could not write the schedule file %s, the jobs aren't kept in it until the next reload.", config.schedfile);
+	now = monotonic_ns();
+	wallclock = wallclock_ns();
+	for (j = 0; j < new.njobs; j++)
+		if (config.jobs.job[j].run.fire == NULL) { /* not moved over, the changed jobs start over like the added ones */
+			job_schedule(&config.jobs.job[j], first_run(&config.jobs.job[j], now, wallclock, hostname));
+			prefork_fill(&config.jobs.job[j]);
+		}
+	if (statefile_reserve())
+		log_msg(LOG_WARNING, NULL, 0, "Could not allocate the buffer of the state file %s, it isn't written anymore.", config.statefile);
+
+	free(oldjobs);
+	free(newjobs);
+	free(match);
+	now = monotonic_ns() - begin;
+	log_msg(LOG_NOTICE, NULL, 0, "Reloaded %s in %llu.%03llu ms: %u jobs kept, %u changed, %u added, %u removed.",
+		config.jobfile, now / NSEC_PER_MSEC, now / 1000 % 1000, kept, changed, added, removed);
+	return;
+
+fail:
+	for (j = 0; j < new.njobs; j++)
+		job_release(&new.job[j]);
+	free_jobs(&new);
+	free(old);
+	free(oldjobs);
+	free(newjobs);
+	free(match);
+}
@@ -0,0 +1,853 @@
+#define _GNU_SOURCE /* ppoll(2) on Linux */
+#include <libowfat/fmt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h> /* the LOG_* levels */
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "minicron.h"
+#include "probes.h"
+
+struct minicron_state state;
+
+/* the signal handler only records the signal, the real work is done by handle_signals() outside of the handler */
+static volatile sig_atomic_t got_sigterm, got_sigchld, got_sighup;
+
+/*
+ * starts killing the child: SIGTERM now, and SIGKILL from kill_timer() once the -K grace of its job has passed
+ * nothing waits here, reap_children() notices when the child has ended - so any number of children can be
+ * terminating at the same time while the main loop goes on
+ * the PID can't have been reused, it stays ours until reap_children() has waited for it
+ */
+void kill_pid(struct proc *proc) {
+	if (proc->pid == 0 || proc->signalled) /* not running, or already on its way out */
+		return;
+
+	log_msg(LOG_NOTICE, NULL, proc->pid, "Sending SIGTERM to PID %d.", proc->pid);
+	MINICRON_SIGTERM(proc->job->name, proc->pid);
+	proc->signalled = SIGTERM;
+	track_signal(proc, SIGTERM);
+
+	/* the -k deadline has served its purpose, the timer now holds the SIGKILL deadline */
+	heap_remove(&state.timers, &proc->kill);
+	if (proc->job->kill_grace)
+		heap_insert(&state.timers, &proc->kill, monotonic_ns() + proc->job->kill_grace);
+}
+
+void catch_signal(int sig) {
+	if (sig == SIGTERM)
+		got_sigterm = 1;
+	else if (sig == SIGCHLD)
+		got_sigchld = 1;
+	else if (sig == SIGHUP)
+		got_sighup = 1;
+}
+
+void setup_signals() {
+	struct sigaction sa;
+	sigset_t mask;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = catch_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGCHLD, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	/* keep the signals blocked, so they can only be delivered while we wait in ppoll(2) */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGHUP);
+	sigprocmask(SIG_BLOCK, &mask, &state.sigmask);
+}
+
+unsigned long long monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+unsigned long long wallclock_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (unsigned long long)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+int watch_add(struct watcher *w) {
+	struct pollfd *pfds;
+	struct watcher **ws;
+	unsigned int n;
+
+	if (w->slot)
+		return 0;
+	if (state.nwatchers == state.watchers_size) {
+		n = state.watchers_size ? 2 * state.watchers_size : 8;
+		if ((pfds = realloc(state.pollfds, n * sizeof(struct pollfd))) == NULL)
+			return 1;
+		state.pollfds = pfds;
+		if ((ws = realloc(state.watchers, n * sizeof(struct watcher*))) == NULL)
+			return 1;
+		state.watchers = ws;
+		state.watchers_size = n;
+	}
+	state.pollfds[state.nwatchers].fd = w->fd;
+	state.pollfds[state.nwatchers].events = w->events;
+	state.pollfds[state.nwatchers].revents = 0;
+	state.watchers[state.nwatchers] = w;
+	w->slot = ++state.nwatchers;
+	return 0;
+}
+
+void watch_remove(struct watcher *w) {
+	unsigned int i = w->slot - 1;
+
+	if (w->slot == 0)
+		return;
+	w->slot = 0;
+	/* the last watcher takes the place of the removed one */
+	if (i != --state.nwatchers) {
+		state.pollfds[i] = state.pollfds[state.nwatchers];
+		state.watchers[i] = state.watchers[state.nwatchers];
+		state.watchers[i]->slot = i + 1;
+	}
+}
+
+void wait_event(unsigned long long deadline) {
+	struct timespec ts, *timeout = NULL;
+	unsigned long long now;
+	unsigned int i;
+	short revents;
+
+	log_flush(); /* the messages of this round go out in one batch, before we sleep */
+	statefile_flush(); /* and so do the children which started or ended */
+
+	if (got_sigterm || got_sigchld || got_sighup) /* there is already work for handle_signals() */
+		return;
+
+	if (deadline != NO_DEADLINE) {
+		/* a deadline which has passed still polls without sleeping, our signals are only delivered in ppoll(2) */
+		now = monotonic_ns();
+		if (now > deadline)
+			now = deadline;
+		ts.tv_sec = (deadline - now) / NSEC_PER_SEC;
+		ts.tv_nsec = (deadline - now) % NSEC_PER_SEC;
+		timeout = &ts;
+	}
+
+	/* returns on timeout, when a watched fd is ready, or with EINTR as soon as one of our signals has been caught */
+	if (ppoll(state.pollfds, state.nwatchers, timeout, &state.sigmask) <= 0)
+		return;
+
+	/*
+	   going backwards, a watcher removing itself only moves an already handled one into its place,
+	   and the revents are cleared first, so a watcher moved by another one isn't called twice
+	*/
+	for (i = state.nwatchers; i-- > 0;) {
+		if (i >= state.nwatchers || (revents = state.pollfds[i].revents) == 0)
+			continue;
+		state.pollfds[i].revents = 0;
+		state.watchers[i]->ready(state.watchers[i], revents);
+	}
+}
+
+void handle_signals() {
+	if (got_sigchld) {
+		got_sigchld = 0;
+		if (state.untracked)
+			reap_children();
+	}
+	if (got_sighup) {
+		got_sighup = 0;
+		if (!state.stopping)
+			reload();
+	}
+	if (got_sigterm) {
+		got_sigterm = 0;
+		if (!state.stopping) {
+			state.stopping = 1;
+			mainloop_stop();
+		}
+	}
+}
+
+/* the fallback for the children track.c couldn't get an exit notification for */
+void reap_children() {
+	struct rusage ru;
+	struct proc *proc;
+	pid_t pid;
+	int status;
+
+	/* every child is waited for exactly once, here or in track.c, so a PID we still hold can't have been reused */
+	while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0)
+		if ((proc = track_find(pid)))
+			child_ended(proc, status, &ru);
+}
+
+void child_ended(struct proc *proc, int status, struct rusage *ru) {
+	struct job *job = proc->job;
+	unsigned long long duration;
+	struct proc **p;
+
+	if (proc->spare) { /* a helper of -Z which died before its run */
+		prefork_ended(proc);
+		return;
+	}
+
+	exec_finish(proc); /* the child may have exited before we have read its report */
+	stats_end(proc, status, ru);
+	output_finish(proc, !WIFEXITED(status) || WEXITSTATUS(status) != 0);
+
+	duration = monotonic_ns() - proc->started;
+	hist_record(&metrics.duration, duration);
+	MINICRON_CHILD_EXIT(job->name, proc->pid, status, duration);
+	if (proc->execfailed)
+		job->outcomes.unstarted++;
+	else if (proc->signalled == SIGKILL)
+		job->outcomes.killed++;
+	else if (proc->signalled == SIGTERM)
+		job->outcomes.terminated++;
+	else if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		job->outcomes.ok++;
+	else
+		job->outcomes.failed++;
+
+	persist_ended(job, proc->execfailed ? -1 : status);
+	backoff_ended(job, proc->execfailed || proc->signalled || !WIFEXITED(status) || WEXITSTATUS(status) != 0);
+	chain_ended(job, proc->execfailed || proc->signalled || !WIFEXITED(status) || WEXITSTATUS(status) != 0);
+
+	heap_remove(&state.timers, &proc->kill);
+	track_end(proc);
+	for (p = &job->procs; *p != proc; p = &(*p)->next);
+	*p = proc->next;
+	proc->pid = 0;
+	proc->next = state.free;
+	state.free = proc;
+
+	if (--job->running == 0)
+		deletepid(job->childpidfile);
+	state.statedirty = 1;
+	state.running--;
+	if (state.admission.n)
+		heap_insert(&state.timers, &state.admit, monotonic_ns());
+
+	/* we may be in the middle of reaping several children, so the queued run is started from the main loop */
+	if (job->pending && job->running < job->max_running) {
+		job->pending = 0;
+		heap_insert(&state.timers, &job->queued, monotonic_ns());
+	}
+	catch_up(job);
+	if (job->retired && job->running == 0 && job->nspares == 0)
+		reload_ended(job);
+}
+
+/* after SIGTERM no more runs are started, the children are killed and the main loop goes on until they have ended */
+void mainloop_stop() {
+	struct jobtable *tab;
+	struct proc *proc;
+	struct timer *t;
+	unsigned int i;
+
+	for (i = 0; i < config.jobs.njobs; i++) {
+		heap_remove(&state.timers, &config.jobs.job[i].run);
+		heap_remove(&state.timers, &config.jobs.job[i].queued);
+		heap_remove(&state.timers, &config.jobs.job[i].claim);
+		config.jobs.job[i].pending = 0;
+		config.jobs.job[i].missed = 0;
+	}
+	while ((t = heap_top(&state.admission)))
+		heap_remove(&state.admission, t);
+	heap_remove(&state.timers, &state.admit);
+
+	chain_stop();
+	prefork_stop();
+
+	log_msg(LOG_NOTICE, NULL, 0, "Received SIGTERM, stopping once %u children have ended.", state.running);
+	for (tab = &config.jobs; tab; tab = tab->next)
+		for (i = 0; i < tab->njobs; i++)
+			for (proc = tab->job[i].procs; proc; proc = proc->next)
+				kill_pid(proc);
+}
+
+void mainloop_exit() {
+	deletepid(config.daemonpidfile);
+	deletepid(config.statefile);
+	metrics_close();
+	control_close();
+	log_msg(LOG_NOTICE, NULL, 0, "Stopping after receiving SIGTERM.");
+	log_close();
+	exit(1);
+}
+
+void mainloop() {
+	unsigned long long now, wallclock, start;
+	char hostname[256];
+	struct timer *t;
+	struct job *job;
+	unsigned int i, n;
+
+	createpid(config.daemonpidfile, getpid());
+
+	signal(SIGINT, SIG_IGN); /* ignoring SIGINT */
+	signal(SIGPIPE, SIG_IGN); /* a metrics client, the socket of -O or a helper of -Z went away, write(2) fails instead */
+	setup_signals();
+
+	/* a slot for every child that may run at the same time, and room for all timers, so scheduling never allocates */
+	for (i = n = 0; i < config.jobs.njobs; i++)
+		n += config.jobs.job[i].max_running + config.jobs.job[i].pool;
+	if (procs_reserve(n) || heap_reserve(&state.timers, 4 * config.jobs.njobs + n + 3) || heap_reserve(&state.admission, config.jobs.njobs)) {
+		log_msg(LOG_ERR, NULL, 0, "Could not allocate the timers for %u jobs.", config.jobs.njobs);
+		log_close();
+		exit(-1);
+	}
+	state.admit.fire = admit_timer;
+	state.chain.fire = chain_timer;
+	state.readytail = &state.ready;
+	if (track_open()) {
+		log_msg(LOG_ERR, NULL, 0, "Could not allocate the PID table for %u children.", n);
+		log_close();
+		exit(-1);
+	}
+	if (calendar_open()) {
+		log_msg(LOG_ERR, NULL, 0, "Could not watch the wall clock for the calendars.");
+		log_close();
+		exit(-1);
+	}
+	if (metrics_open()) {
+		log_msg(LOG_ERR, NULL, 0, "Could not serve the metrics on %s.", config.metrics);
+		log_close();
+		exit(-1);
+	}
+	if (control_open()) {
+		log_msg(LOG_ERR, NULL, 0, "Could not serve the control socket on %s.", config.control);
+		log_close();
+		exit(-1);
+	}
+	if (statefile_reserve()) {
+		log_msg(LOG_ERR, NULL, 0, "Could not allocate the buffer of the state file %s.", config.statefile);
+		log_close();
+		exit(-1);
+	}
+	if (persist_open()) {
+		log_msg(LOG_ERR, NULL, 0, "Could not write the schedule file %s.", config.schedfile);
+		log_close();
+		exit(-1);
+	}
+
+	/* every job goes on where the schedule file of -H left it, or runs right away or at its splayed phase, and then on its own interval boundaries */
+	if (gethostname(hostname, sizeof(hostname)))
+		hostname[0] = '\0';
+	hostname[sizeof(hostname) - 1] = '\0';
+	now = monotonic_ns();
+	wallclock = wallclock_ns();
+	for (i = 0; i < config.jobs.njobs; i++) {
+		job = &config.jobs.job[i];
+		if (job_open(job)) {
+			log_close();
+			exit(-1);
+		}
+		if (!persist_resume(job, now, wallclock, &start))
+			start = first_run(job, now, wallclock, hostname);
+		job_schedule(job, start);
+	}
+	/* once everything the children use is open */
+	for (i = 0; i < config.jobs.njobs; i++)
+		prefork_fill(&config.jobs.job[i]);
+
+	while (1) {
+		/* sleep until the earliest run or -k deadline, but reap the children and react to SIGTERM as soon as the signals arrive */
+		t = heap_top(&state.timers);
+		wait_event(t ? t->when : NO_DEADLINE);
+		handle_signals();
+		if (state.stopping && state.running == 0)
+			mainloop_exit();
+
+		/* only the expired timers are looked at, the firing ones reschedule themselves */
+		now = monotonic_ns();
+		while ((t = heap_top(&state.timers)) && t->when <= now) {
+			heap_remove(&state.timers, t);
+			t->fire(t, now);
+		}
+	}
+}
+
+/* makes the buffer of -T big enough for a line for every child that may run, so writing the state file never allocates */
+int statefile_reserve() {
+	struct jobtable *t;
+	unsigned int i;
+	size_t n = 0;
+	char *buf;
+
+	if (config.statefile == NULL)
+		return 0;
+	for (i = 0; i < config.jobs.njobs; i++)
+		n += config.jobs.job[i].max_running * (strlen(config.jobs.job[i].name) + 2 * FMT_ULONG + 3);
+	for (t = config.jobs.next; t; t = t->next) /* the retired jobs don't start new children */
+		for (i = 0; i < t->njobs; i++)
+			if (t->job[i].running)
+				n += t->job[i].running * (strlen(t->job[i].name) + 2 * FMT_ULONG + 3);
+	state.statedirty = 1;
+	if (n <= state.statesize)
+		return 0;
+	if ((buf = realloc(state.statebuf, n)) == NULL)
+		return 1;
+	state.statebuf = buf;
+	state.statesize = n;
+	return 0;
+}
+
+/* rewrites the state file of -T, once per round of the event loop however many children started or ended in it */
+void statefile_flush() {
+	static unsigned short failed;
+	unsigned long long now, wallclock;
+	struct jobtable *t;
+	struct proc *proc;
+	unsigned int i;
+	char *p;
+
+	if (!state.statedirty || state.statebuf == NULL)
+		return;
+	state.statedirty = 0;
+
+	now = monotonic_ns();
+	wallclock = wallclock_ns();
+	p = state.statebuf;
+	for (t = &config.jobs; t; t = t->next)
+		for (i = 0; i < t->njobs; i++)
+			for (proc = t->job[i].procs; proc; proc = proc->next) {
+				p += fmt_ulong(p, proc->pid);
+				*p++ = ' ';
+				p += fmt_str(p, proc->job->name);
+				*p++ = ' ';
+				p += fmt_ulonglong(p, (wallclock - (now - proc->started)) / NSEC_PER_SEC);
+				*p++ = '\n';
+			}
+
+	/* only complain once until it works again */
+	if (write_atomic(config.statefile, state.statebuf, p - state.statebuf, 0644)) {
+		if (!failed)
+			log_msg(LOG_WARNING, NULL, 0, "Could not write the state file %s.", config.statefile);
+		failed = 1;
+	}
+	else
+		failed = 0;
+}
+
+/* allocates more slots for children, until there are n - the slots are never freed, the timers and watchers in them are referenced */
+int procs_reserve(unsigned int n) {
+	struct proc *procs;
+	unsigned int i;
+
+	if (n <= state.nprocs)
+		return 0;
+	if ((procs = calloc(n - state.nprocs, sizeof(struct proc))) == NULL)
+		return 1;
+	for (i = 0; i < n - state.nprocs; i++) {
+		procs[i].kill.fire = kill_timer;
+		procs[i].out.fd = -1;
+		procs[i].pidfd.fd = -1;
+		procs[i].go = -1;
+		procs[i].exec.fd = -1;
+		procs[i].out.ready = output_ready;
+		procs[i].next = state.free;
+		state.free = &procs[i];
+	}
+	state.nprocs = n;
+	return 0;
+}
+
+/* opens what the children of the job use, returns 1 and logs if the job can't run */
+int job_open(struct job *job) {
+	if (job->calendar && calendar_next(&job->cal, wallclock_ns()) == 0) {
+		log_msg(LOG_ERR, job, 0, "The calendar %s of %s has no runs.", job->calendar, job->name);
+		return 1;
+	}
+	if (exec_open(job) || isolate_open(job) || stats_open(job) || lease_open(job))
+		return 1;
+	if (output_open(job)) {
+		log_msg(LOG_ERR, job, 0, "Could not allocate the output buffer of %s.", job->name);
+		return 1;
+	}
+	return 0;
+}
+
+/* puts the first run of the job on the timer heap, and the missed ones persist_resume() has found right after it */
+void job_schedule(struct job *job, unsigned long long start) {
+	job->start = start;
+	job->tick = 0;
+	job->run.fire = run_timer;
+	job->queued.fire = queued_timer;
+	if (job->after) /* started by chain.c once its predecessors have succeeded */
+		return;
+	heap_insert(&state.timers, &job->run, job->start);
+	lease_schedule(job);
+	persist_due(job);
+	catch_up(job);
+}
+
+/* starts the next of the missed runs of -U once nothing else of the job is running or waiting, called again when it has ended */
+void catch_up(struct job *job) {
+	if (job->missed == 0 || job->running || job->pending || job->queued.slot || job->admit.slot || state.stopping)
+		return;
+	job->missed--;
+	job->due = monotonic_ns();
+	heap_insert(&state.timers, &job->queued, job->due);
+}
+
+/*
+ * the monotonic time of the first run, all later runs follow at multiples of the interval
+ * with -S the runs are put on the wall clock interval boundaries (the same on every host), shifted by a phase offset
+ * which is derived from a hash of the hostname and the job name - so the fleet spreads evenly over the window,
+ * but a given job on a given host always runs at the same phase
+ */
+unsigned long long first_run(struct job *job, unsigned long long now, unsigned long long wallclock, char *hostname) {
+	unsigned long long window, hash, offset, next;
+	char *p;
+
+	if (job->calendar) { /* -S doesn't apply, the runs are at the given minute */
+		if ((job->fire = calendar_next(&job->cal, wallclock)) == 0)
+			return NO_DEADLINE;
+		return now + (job->fire - wallclock);
+	}
+	window = job->splay != SPLAY_NONE ? job->splay : config.splay;
+	if (window == SPLAY_NONE || job->interval == 0)
+		return now;
+	if (window > job->interval)
+		window = job->interval;
+
+	/* FNV-1a over the hostname, a separator and the job name */
+	hash = 14695981039346656037ULL;
+	for (p = hostname; *p; p++)
+		hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+	hash *= 1099511628211ULL;
+	for (p = job->name; *p; p++)
+		hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+	offset = window ? hash % window : 0;
+
+	/* the first wall clock boundary + offset which isn't in the past */
+	next = wallclock - wallclock % job->interval + offset;
+	if (next < wallclock)
+		next += job->interval;
+
+	log_msg(LOG_INFO, job, 0, "Splaying %s by %llu.%03llu ms, the first run is in %llu.%03llu ms.", job->name, offset / NSEC_PER_MSEC, offset / 1000 % 1000, (next - wallclock) / NSEC_PER_MSEC, (next - wallclock) / 1000 % 1000);
+	return now + (next - wallclock);
+}
+
+void run_timer(struct timer *t, unsigned long long now) {
+	run_job(TIMER_OWNER(t, struct job, run), now);
+}
+
+/* the -k deadline of a running child, or the end of the grace after SIGTERM */
+void kill_timer(struct timer *t, unsigned long long now) {
+	struct proc *proc = TIMER_OWNER(t, struct proc, kill);
+
+	(void)now;
+	if (proc->signalled == 0)
+		kill_pid(proc);
+	else if (proc->signalled == SIGTERM) {
+		log_msg(LOG_NOTICE, NULL, proc->pid, "Sending SIGKILL to PID %d.", proc->pid);
+		MINICRON_SIGKILL(proc->job->name, proc->pid);
+		proc->signalled = SIGKILL;
+		track_signal(proc, SIGKILL);
+	}
+}
+
+/* the run queued by -o queue or made up for -U, -B and -l may still drop it since it was put */
+void queued_timer(struct timer *t, unsigned long long now) {
+	struct job *job = TIMER_OWNER(t, struct job, queued);
+
+	if (!run_allowed(job, now, 0)) {
+		job->missed = 0; /* the rest of them would be dropped as well */
+		return;
+	}
+	request_start(job);
+}
+
+/* -C and -R, the token bucket is kept as the time at which it would be full again */
+int may_start(unsigned long long now) {
+	unsigned long long cost;
+
+	if (config.max_children && state.running >= config.max_children)
+		return 0;
+	if (config.spawn_rate) {
+		cost = NSEC_PER_SEC / config.spawn_rate;
+		if (state.spawn_tat < now)
+			state.spawn_tat = now;
+		if (state.spawn_tat - now > (config.spawn_burst - 1) * cost)
+			return 0;
+	}
+	return 1;
+}
+
+/* starts the run now if -C and -R allow it and nobody is waiting, otherwise it waits in the admission queue */
+void request_start(struct job *job) {
+	unsigned long long now = monotonic_ns();
+
+	if (state.admission.n == 0 && may_start(now)) {
+		start_child(job);
+		return;
+	}
+
+	job->admit_since = now;
+	heap_insert(&state.admission, &job->admit, (unsigned long long)(0xffff - job->priority) << 48 | (state.admission_seq++ & 0xffffffffffffULL));
+	if (state.admission.n > state.admission_stats.depth_max)
+		state.admission_stats.depth_max = state.admission.n;
+	log_msg(LOG_INFO, job, 0, "%s is waiting for admission (%u runs waiting).", job->name, state.admission.n);
+	if (!state.admit.slot)
+		heap_insert(&state.timers, &state.admit, now);
+}
+
+void admit_timer(struct timer *t, unsigned long long now) {
+	unsigned long long wait;
+	struct job *job;
+
+	(void)t;
+	while ((t = heap_top(&state.admission)) && may_start(now)) {
+		heap_remove(&state.admission, t);
+		job = TIMER_OWNER(t, struct job, admit);
+		wait = now - job->admit_since;
+		state.admission_stats.waited++;
+		state.admission_stats.wait_total += wait;
+		if (wait > state.admission_stats.wait_max)
+			state.admission_stats.wait_max = wait;
+		log_msg(LOG_INFO, job, 0, "Admitted %s after waiting %llu.%03llu ms (%u runs waiting).", job->name, wait / NSEC_PER_MSEC, wait / 1000 % 1000, state.admission.n);
+		start_child(job);
+	}
+
+	/* a full -C is retried when a child ends, an empty token bucket when the next token is due */
+	if (state.admission.n && config.spawn_rate && (!config.max_children || state.running < config.max_children))
+		heap_insert(&state.timers, &state.admit, state.spawn_tat - (config.spawn_burst - 1) * (NSEC_PER_SEC / config.spawn_rate));
+}
+
+void kill_job(struct job *job) {
+	struct proc *proc;
+
+	for (proc = job->procs; proc; proc = proc->next)
+		kill_pid(proc);
+}
+
+void run_job(struct job *job, unsigned long long now) {
+	unsigned long long period, late, missed = 0, limit, wallclock = 0, last, next;
+	unsigned short skip = 0;
+
+	/*
+	   the n-th run is due at start + n*interval on the monotonic clock, so the time spent in fork(2)
+	   and logging doesn't accumulate and the runs stay aligned to the interval boundaries
+	   a calendar has its runs on the wall clock, each one is converted to the monotonic clock when it is put
+	*/
+	period = job->interval;
+	late = now - job->run.when;
+	if (job->calendar) {
+		wallclock = wallclock_ns();
+		if (job->fire > wallclock + NSEC_PER_SEC) { /* the clock went back and calendar.c hasn't noticed yet */
+			heap_insert(&state.timers, &job->run, now + (job->fire - wallclock));
+			lease_schedule(job);
+			return;
+		}
+		late = wallclock > job->fire ? wallclock - job->fire : 0;
+		if ((missed = calendar_missed(&job->cal, job->fire, wallclock, &last))) /* realign to the last run which has passed */
+			late = wallclock - last;
+	}
+	else if (period && late >= period) { /* we overslept whole intervals (e.g. the host was suspended), realign to the last boundary */
+		missed = late / period;
+		job->tick += missed;
+		late -= missed * period;
+	}
+	if (missed) { /* this run is one of the missed ones too, -U says how many of them are made up */
+		limit = job->lease ? 1 : job->has_catchup ? job->catchup : config.catchup; /* with -l, the other hosts may have run them */
+		if (limit == 0)
+			skip = 1;
+		else { /* the ones still to be made up from an earlier oversleep count against the limit too */
+			job->missed += missed;
+			if (job->missed > limit - 1)
+				job->missed = limit - 1;
+		}
+		log_msg(LOG_WARNING, job, 0, "Missed %llu runs of %s, making up %llu of them and continuing from the last one.", missed + 1, job->name, skip ? 0 : 1 + job->missed);
+	}
+	job->due = now - late;
+	hist_record(&metrics.lateness, late);
+	MINICRON_TICK_FIRE(job->name, job->tick, late);
+	log_msg(LOG_DEBUG, job, 0, "Tick %llu of %s fired %llu.%03llu ms late.", job->tick, job->name, late / NSEC_PER_MSEC, late / 1000 % 1000);
+
+	if (!skip)
+		run_due(job, now);
+
+	job->tick++;
+	if (job->calendar == NULL) {
+		next = job->start + job->tick * period;
+		if (next <= now) /* mainloop() would fire it again right away, without ever getting back to ppoll(2) */
+			next = now + 1;
+		heap_insert(&state.timers, &job->run, next);
+	}
+	else if ((job->fire = calendar_next(&job->cal, wallclock > job->fire ? wallclock : job->fire))) /* not before the one just run, if the timer was early */
+		heap_insert(&state.timers, &job->run, now + (job->fire - wallclock));
+	lease_schedule(job);
+	persist_due(job);
+}
+
+/* -B and -l, whether a run may start at all - with claim the lease is claimed for the run due now, see lease.c */
+int run_allowed(struct job *job, unsigned long long now, int claim) {
+	if (job->backoff_until > now) { /* see backoff.c */
+		job->backoffs.skipped++;
+		log_msg(LOG_DEBUG, job, 0, "%s has failed %u times in a row, skipping this run (%llu.%03llu s until the next one may start).", job->name, job->failures, (job->backoff_until - now) / NSEC_PER_SEC, (job->backoff_until - now) / NSEC_PER_MSEC % 1000);
+		return 0;
+	}
+	return claim ? lease_held(job, now) : lease_kept(job); /* or another host runs this one */
+}
+
+/* a run of the job is due now, -B, -l, the admission queue and the overlap policy decide whether it starts - called by run_job() and chain.c */
+void run_due(struct job *job, unsigned long long now) {
+	unsigned short skip = 0;
+
+	if (!run_allowed(job, now, 1))
+		skip = 1;
+	else if (job->admit.slot) { /* the previous run hasn't even been admitted yet */
+		job->overlaps.skipped++;
+		log_msg(LOG_INFO, job, 0, "%s is still waiting for admission, skipping this run (%llu times so far).", job->name, job->overlaps.skipped);
+	}
+	else if (job->running > 0) { /* the previous run is still going */
+		switch (job->overlap) {
+			case OVERLAP_KILL: /* the run starts once the killed child has ended, like a queued one */
+				job->overlaps.killed++;
+				log_msg(LOG_INFO, job, 0, "%s is still running, killing it (%llu times so far).", job->name, job->overlaps.killed);
+				kill_job(job);
+				job->pending = 1;
+				break;
+			case OVERLAP_SKIP:
+				job->overlaps.skipped++;
+				log_msg(LOG_INFO, job, 0, "%s is still running, skipping this run (%llu times so far).", job->name, job->overlaps.skipped);
+				break;
+			case OVERLAP_QUEUE:
+				if (job->pending) { /* the queue holds only one run */
+					job->overlaps.skipped++;
+					log_msg(LOG_INFO, job, 0, "%s is still running and a run is already queued, skipping this run (%llu times so far).", job->name, job->overlaps.skipped);
+				}
+				else {
+					job->overlaps.queued++;
+					job->pending = 1;
+					log_msg(LOG_INFO, job, 0, "%s is still running, queueing this run (%llu times so far).", job->name, job->overlaps.queued);
+				}
+				break;
+			case OVERLAP_CONCURRENT:
+				if (job->running < job->max_running) {
+					job->overlaps.concurrent++;
+					log_msg(LOG_INFO, job, 0, "%s is still running, starting another run alongside (%llu times so far).", job->name, job->overlaps.concurrent);
+				}
+				else {
+					job->overlaps.skipped++;
+					log_msg(LOG_INFO, job, 0, "%s is running %u times already, skipping this run (%llu times so far).", job->name, job->running, job->overlaps.skipped);
+				}
+				break;
+		}
+	}
+	if (!skip && !job->admit.slot && !state.stopping && job->running < job->max_running && !job->pending)
+		request_start(job);
+}
+
+void start_child(struct job *job) {
+	char kill_after[FMT_DURATION];
+	struct proc *proc;
+	pid_t pid;
+
+	if (MINICRON_SPAWN_START_ENABLED())
+		MINICRON_SPAWN_START(job->name, monotonic_ns() - job->due);
+	if ((proc = prefork_take(job))) { /* a helper of -Z is waiting, it only has to exec */
+		pid = proc->pid;
+		proc->due = job->due;
+		exec_watch(proc);
+	}
+	else {
+		if ((proc = state.free) == NULL) /* can't happen, there is a slot for max_running children of every job */
+			return;
+		proc->job = job;
+		proc->due = job->due;
+		output_start(proc);
+		exec_start(proc);
+		stats_start(proc);
+
+		/* the child runs directly under the main loop, which reaps it and enforces -k, so there is no supervisor process */
+		pid = vfork();
+		if (pid < 0) { /* fork failed, we'll try again on the next tick */
+			log_msg(LOG_ERR, job, 0, "Could not fork %s, skipping this run.", job->name);
+			metrics.spawn_failures++;
+			if (proc->out.fd >= 0) {
+				close(proc->outw);
+				output_close(proc);
+			}
+			if (proc->exec.fd >= 0) {
+				close(proc->exec.fd);
+				close(proc->execw);
+			}
+			return;
+		}
+		else if (pid == 0)
+			child(proc);
+		/* vfork(2) returns once the child has called execve(2) (or _exit(2) if that failed) */
+		/* if it has exited already, it is reaped like any other */
+		exec_started(proc);
+		output_started(proc);
+		state.free = proc->next;
+		proc->pid = pid;
+		track_start(proc);
+	}
+	proc->started = monotonic_ns();
+	proc->signalled = 0;
+
+	if (config.spawn_rate)
+		state.spawn_tat += NSEC_PER_SEC / config.spawn_rate;
+	state.running++;
+
+	proc->next = job->procs;
+	job->procs = proc;
+	job->running++;
+
+	createpid(job->childpidfile, pid);
+	persist_started(job);
+	state.statedirty = 1;
+
+	if (proc->execfailed)
+		;
+	else if (job->kill_after) {
+		fmt_duration(kill_after, job->kill_after);
+		log_msg(LOG_NOTICE, job, pid, "Started %s (PID %d). Will wait %s before killing it.", job->name, pid, kill_after);
+	}
+	else
+		log_msg(LOG_NOTICE, job, pid, "Started %s (PID %d).", job->name, pid);
+
+	if (job->kill_after)
+		heap_insert(&state.timers, &proc->kill, monotonic_ns() + job->kill_after);
+}
+
+int child(struct proc *proc) {
+	struct job *job = proc->job;
+	unsigned int i, k;
+	int failed;
+
+	/*
+	   we share the memory of the main loop until execve(2), so restore the default handlers before unblocking
+	   the signals - otherwise catch_signal() could run here and set the flags of the parent
+	*/
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL); /* an ignored signal stays ignored across execve(2) */
+	sigprocmask(SIG_SETMASK, &state.sigmask, NULL); /* don't leave our signals blocked in the job */
+	output_child(proc);
+	/* the fds of -F are the only ones without O_CLOEXEC, close those some other job passes */
+	for (i = 0; i < config.npassfds; i++) {
+		for (k = 0; k < job->npassfds && job->passfds[k] != config.passfds[i]; k++);
+		if (k == job->npassfds)
+			close(config.passfds[i]);
+	}
+	/* better not to run than to run on the cores we were told to keep free */
+	failed = isolate_child(job);
+	if (proc->spare) /* a helper of -Z, set up ahead of its run */
+		prefork_wait(proc);
+	exec_child(proc, failed);
+	return -1;
+}
@@ -0,0 +1,167 @@
+#include <fcntl.h>
+#include <libowfat/scan.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <syslog.h> /* the LOG_* levels */
+#include <unistd.h>
+
+#include "minicron.h"
+
+/*
+ * the resources every run used: the rusage wait4(2) returns with the exit status, and with -g the counters
+ * of the cgroup v2 the children of the job are moved into, as the difference between the start and the end
+ * of the run (so runs overlapping in the same cgroup are counted by each of them)
+ * memory.peak can't be subtracted, it is reset when a run starts and no other one is running (since Linux 6.12),
+ * so overlapping runs share the peak since the first of them - older kernels only have the peak of the cgroup
+ * since it was created, which the log line then says
+ * the last RUN_WINDOW runs of a job are kept for the rolling percentiles of the metrics
+ */
+#define STATS_FILE 4096 /* cpu.stat and io.stat are read in one go */
+
+static size_t read_file(int, const char*, char*);
+static unsigned long long stat_field(const char*, const char*);
+static void cgroup_read(int, struct cgstat*);
+static int cmp_ull(const void*, const void*);
+
+/* opens the directory of -g, the files in it are opened relative to it, also by child() */
+int stats_open(struct job *job) {
+	job->cgfd = job->peakfd = -1;
+	/* not in the job, a reload moves the jobs which haven't changed */
+	if ((job->runs = calloc(RUN_WINDOW, sizeof(struct runstat))) == NULL) {
+		log_msg(LOG_ERR, job, 0, "Could not allocate the run statistics of %s.", job->name);
+		return 1;
+	}
+	if (job->cgroup == NULL)
+		return 0;
+	if ((job->cgfd = open(job->cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		log_msg(LOG_ERR, job, 0, "Could not open the cgroup %s of %s.", job->cgroup, job->name);
+		return 1;
+	}
+	if ((job->peakfd = openat(job->cgfd, "memory.peak", O_RDWR | O_CLOEXEC)) < 0) /* read-only before Linux 6.12 */
+		job->peakfd = openat(job->cgfd, "memory.peak", O_RDONLY | O_CLOEXEC);
+	return 0;
+}
+
+static size_t read_file(int dir, const char *name, char *buf) {
+	ssize_t n;
+	int fd;
+
+	if ((fd = openat(dir, name, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+	n = read(fd, buf, STATS_FILE - 1);
+	close(fd);
+	if (n < 0)
+		n = 0;
+	buf[n] = '\0';
+	return n;
+}
+
+/* the sum of every "key value" and "key=value" with this key, io.stat has one line per device */
+static unsigned long long stat_field(const char *buf, const char *key) {
+	unsigned long long sum = 0, v;
+	size_t len = strlen(key);
+	const char *p;
+
+	for (p = buf; (p = strstr(p, key)); p += len)
+		if ((p == buf || p[-1] == ' ' || p[-1] == '\n') && (p[len] == ' ' || p[len] == '=') && scan_ulonglong(p + len + 1, &v))
+			sum += v;
+	return sum;
+}
+
+static void cgroup_read(int dir, struct cgstat *cg) {
+	char buf[STATS_FILE];
+
+	memset(cg, 0, sizeof(*cg));
+	if (read_file(dir, "cpu.stat", buf))
+		cg->cpu = stat_field(buf, "usage_usec") * 1000;
+	if (read_file(dir, "io.stat", buf)) {
+		cg->rbytes = stat_field(buf, "rbytes");
+		cg->wbytes = stat_field(buf, "wbytes");
+	}
+}
+
+/* before vfork(2), so nothing the child does is missed */
+void stats_start(struct proc *proc) {
+	struct job *job = proc->job;
+
+	if (job->cgfd < 0)
+		return;
+	cgroup_read(job->cgfd, &proc->cg);
+	if (job->peakfd >= 0 && job->running == 0)
+		job->peak_reset = write(job->peakfd, "reset\n", 6) == 6;
+}
+
+/* called by child_ended(), logs the end of the run with what it used */
+void stats_end(struct proc *proc, int status, struct rusage *ru) {
+	struct job *job = proc->job;
+	struct runstat *r = &job->runs[job->nruns++ % RUN_WINDOW];
+	char how[32], duration[FMT_DURATION], buf[192], peak[32];
+	unsigned long long utime, stime;
+	struct cgstat cg;
+	ssize_t n;
+
+	utime = (unsigned long long)ru->ru_utime.tv_sec * NSEC_PER_SEC + ru->ru_utime.tv_usec * 1000ULL;
+	stime = (unsigned long long)ru->ru_stime.tv_sec * NSEC_PER_SEC + ru->ru_stime.tv_usec * 1000ULL;
+	r->duration = monotonic_ns() - proc->started;
+	r->cpu = utime + stime;
+	r->maxrss = ru->ru_maxrss * 1024ULL; /* in kilobytes on Linux and the BSDs */
+
+	job->usage.utime += utime;
+	job->usage.stime += stime;
+	job->usage.inblock += ru->ru_inblock;
+	job->usage.oublock += ru->ru_oublock;
+	job->usage.nvcsw += ru->ru_nvcsw;
+	job->usage.nivcsw += ru->ru_nivcsw;
+
+	buf[0] = '\0';
+	if (job->cgfd >= 0) {
+		cgroup_read(job->cgfd, &cg);
+		cg.cpu -= cg.cpu >= proc->cg.cpu ? proc->cg.cpu : cg.cpu;
+		cg.rbytes -= cg.rbytes >= proc->cg.rbytes ? proc->cg.rbytes : cg.rbytes;
+		cg.wbytes -= cg.wbytes >= proc->cg.wbytes ? proc->cg.wbytes : cg.wbytes;
+		job->usage.cg_cpu += cg.cpu;
+		job->usage.cg_rbytes += cg.rbytes;
+		job->usage.cg_wbytes += cg.wbytes;
+		if (job->peakfd >= 0 && (n = pread(job->peakfd, peak, sizeof(peak) - 1, 0)) > 0) {
+			peak[n] = '\0';
+			scan_ulonglong(peak, &cg.memory_peak);
+		}
+		snprintf(buf, sizeof(buf), ", cgroup %llu.%03llus CPU, %llu bytes read, %llu written, %llu bytes peak memory%s",
+			cg.cpu / NSEC_PER_SEC, cg.cpu / NSEC_PER_MSEC % 1000, cg.rbytes, cg.wbytes, cg.memory_peak, job->peak_reset ? "" : " of the cgroup so far");
+	}
+
+	if (WIFEXITED(status))
+		snprintf(how, sizeof(how), "exited with %d", WEXITSTATUS(status));
+	else
+		snprintf(how, sizeof(how), "was killed by signal %d", WTERMSIG(status));
+	fmt_duration(duration, r->duration / NSEC_PER_MSEC * NSEC_PER_MSEC);
+	log_msg(LOG_NOTICE, job, proc->pid, "The child %s (PID %d) has ended: %s after %s, %llu.%03llus user, %llu.%03llus sys, %ld kB max RSS, %ld/%ld blocks in/out, %ld/%ld voluntary/involuntary context switches%s.",
+		job->name, proc->pid, how, duration, utime / NSEC_PER_SEC, utime / NSEC_PER_MSEC % 1000, stime / NSEC_PER_SEC, stime / NSEC_PER_MSEC % 1000,
+		ru->ru_maxrss, ru->ru_inblock, ru->ru_oublock, ru->ru_nvcsw, ru->ru_nivcsw, buf);
+}
+
+static int cmp_ull(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+   the quantiles (in thousandths) of one field of the last runs of the job, by sorting a copy of the window
+   returns how many runs there were, 0 if none
+*/
+unsigned int stats_percentiles(struct job *job, size_t field, const unsigned int *q, unsigned long long *dest, unsigned int nq) {
+	unsigned long long v[RUN_WINDOW];
+	unsigned int i, n = job->nruns < RUN_WINDOW ? job->nruns : RUN_WINDOW;
+
+	if (n == 0)
+		return 0;
+	for (i = 0; i < n; i++)
+		v[i] = *(unsigned long long*)((char*)&job->runs[i] + field);
+	qsort(v, n, sizeof(v[0]), cmp_ull);
+	for (i = 0; i < nq; i++)
+		dest[i] = v[(q[i] * (n - 1) + 500) / 1000];
+	return n;
+}
@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__) || defined(__APPLE__)
+#include <sys/event.h>
+#define TRACK_KQUEUE
+#endif
+
+#include "minicron.h"
+
+/*
+ * every child gets an exit notification of its own, so we learn which child has ended without calling
+ * waitpid(-1) and then wait4(2) for exactly that PID - a PID we haven't waited for yet can't be reused,
+ * so signalling and reaping it is race-free
+ * on Linux, the notification is a pidfd, which also signals the child with pidfd_send_signal(2)
+ * on the BSDs, it is an EVFILT_PROC filter in one kqueue, which is watched by the event loop like any fd
+ * where neither works, the child is untracked and reap_children() falls back to waitpid(-1) on SIGCHLD,
+ * looking the PID up in a hash of the running children
+ */
+#ifdef TRACK_KQUEUE
+#define TRACK_EVENTS 64 /* kevent(2) results per call */
+
+static struct watcher kq = { -1, POLLIN, 0, NULL };
+static void kq_ready(struct watcher*, short);
+#endif
+
+static struct proc **pidhash;
+static unsigned int pidmask;
+
+#ifdef __linux__
+static void pidfd_ready(struct watcher*, short);
+#endif
+static void reap(struct proc*);
+
+int track_open() {
+	unsigned int n = 1;
+
+	/* a power of two, at least twice the number of children that may run at a time */
+	while (n < 2 * state.nprocs)
+		n *= 2;
+	if ((pidhash = calloc(n, sizeof(struct proc*))) == NULL)
+		return 1;
+	pidmask = n - 1;
+
+#ifdef TRACK_KQUEUE
+	if ((kq.fd = kqueue()) >= 0) {
+		kq.ready = kq_ready;
+		if (watch_add(&kq)) {
+			close(kq.fd);
+			kq.fd = -1;
+		}
+	}
+#endif
+	return 0;
+}
+
+/* called in the parent right after vfork(2), the child can't have been reaped yet */
+void track_start(struct proc *proc) {
+	struct proc **h = &pidhash[proc->pid & pidmask];
+
+	proc->hnext = *h;
+	*h = proc;
+
+	proc->tracked = 0;
+	proc->pidfd.fd = -1;
+#if defined(__linux__) && defined(SYS_pidfd_open)
+	if ((proc->pidfd.fd = syscall(SYS_pidfd_open, proc->pid, 0)) >= 0) {
+		proc->pidfd.events = POLLIN;
+		proc->pidfd.ready = pidfd_ready;
+		if (!watch_add(&proc->pidfd))
+			proc->tracked = 1;
+		else {
+			close(proc->pidfd.fd);
+			proc->pidfd.fd = -1;
+		}
+	}
+#endif
+#ifdef TRACK_KQUEUE
+	{
+		struct kevent ev;
+
+		EV_SET(&ev, proc->pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, (void*)proc);
+		if (kq.fd >= 0 && kevent(kq.fd, &ev, 1, NULL, 0, NULL) == 0)
+			proc->tracked = 1;
+	}
+#endif
+	if (!proc->tracked)
+		state.untracked++;
+}
+
+/* called by child_ended() */
+void track_end(struct proc *proc) {
+	struct proc **h;
+
+	for (h = &pidhash[proc->pid & pidmask]; *h != proc; h = &(*h)->hnext);
+	*h = proc->hnext;
+
+	if (proc->pidfd.fd >= 0) {
+		watch_remove(&proc->pidfd);
+		close(proc->pidfd.fd);
+		proc->pidfd.fd = -1;
+	}
+	if (!proc->tracked)
+		state.untracked--;
+}
+
+/* grows the PID hash along with the slots a reload added, returns 1 if it couldn't, then the chains are just longer */
+int track_resize() {
+	struct proc **h, *proc, *next;
+	unsigned int i, n = pidmask + 1;
+
+	if (n >= 2 * state.nprocs)
+		return 0;
+	while (n < 2 * state.nprocs)
+		n *= 2;
+	if ((h = calloc(n, sizeof(struct proc*))) == NULL)
+		return 1;
+	for (i = 0; i <= pidmask; i++)
+		for (proc = pidhash[i]; proc; proc = next) {
+			next = proc->hnext;
+			proc->hnext = h[proc->pid & (n - 1)];
+			h[proc->pid & (n - 1)] = proc;
+		}
+	free(pidhash);
+	pidhash = h;
+	pidmask = n - 1;
+	return 0;
+}
+
+struct proc *track_find(pid_t pid) {
+	struct proc *proc;
+
+	for (proc = pidhash[pid & pidmask]; proc && proc->pid != pid; proc = proc->hnext);
+	return proc;
+}
+
+void track_signal(struct proc *proc, int sig) {
+#if defined(__linux__) && defined(SYS_pidfd_send_signal)
+	if (proc->pidfd.fd >= 0 && syscall(SYS_pidfd_send_signal, proc->pidfd.fd, sig, NULL, 0) == 0)
+		return;
+#endif
+	kill(proc->pid, sig);
+}
+
+static void reap(struct proc *proc) {
+	struct rusage ru;
+	int status;
+
+	if (wait4(proc->pid, &status, WNOHANG, &ru) == proc->pid)
+		child_ended(proc, status, &ru);
+}
+
+#ifdef __linux__
+static void pidfd_ready(struct watcher *w, short revents) {
+	(void)revents;
+	reap(WATCHER_OWNER(w, struct proc, pidfd));
+}
+#endif
+
+#ifdef TRACK_KQUEUE
+static void kq_ready(struct watcher *w, short revents) {
+	struct kevent evs[TRACK_EVENTS];
+	struct timespec zero = { 0, 0 };
+	int i, n;
+
+	(void)revents;
+	n = kevent(w->fd, NULL, 0, evs, TRACK_EVENTS, &zero);
+	for (i = 0; i < n; i++)
+		if (evs[i].filter == EVFILT_PROC && (evs[i].fflags & NOTE_EXIT))
+			reap((struct proc*)evs[i].udata);
+}
+#endif